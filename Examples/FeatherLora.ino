@@ -30,6 +30,7 @@ static bool _DidPrintError = false;
 static int16_t packetnum = 0; // packet counter, we increment per xmission
 static unsigned long _SendTime = 0;
 static int _SendInterval = 6000;
+static bool _ForwardToHost = false;	// gateway mode: send packets to the host as binary frames (extras/host)
 
 // our LoraUtil static object
 static LoraUtil* _Lru = NULL;
@@ -37,6 +38,7 @@ static LoraUtil* _Lru = NULL;
 void setup()
 {
 	ASeries.Start(115200);
+	ASeries.SetFramed(_ForwardToHost);
 	ASeries.println("Feather Test!");
 
 	// sit for 4 seconds in case something later crashes
@@ -87,6 +89,8 @@ void BlinkLed(bool onOff)
 // Arduino Loop
 void loop()
 {
+	ASeries.Drain();	// push any queued log output (e.g. from the interrupt handler) to Serial
+	_Lru->Service();	// afc, adr and other housekeeping that can't run in the interrupt
 	// if we've received a packet, read it and respond to it
 	if( _Lru->IsPacketAvailable())
 	{
@@ -98,7 +102,10 @@ void loop()
 			if(pkt->msgTxt.length() > 3)
 			{
 				String txt = pkt->msgTxt;
-				ASeries.println("Received: " + txt);
+				if(_ForwardToHost)
+					_Lru->ForwardToHost(pkt);
+				else
+					ASeries.println("Received: " + txt);
 				String sending = "U" + String(pkt->rssi)+"." + String(pkt->snr) + "." + String(packetnum);
 				delay(200);					// let the other side switch to receive mode
 				_DidPrintError = false;		// allow print of next error
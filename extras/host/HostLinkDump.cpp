@@ -0,0 +1,65 @@
+// hostlinkdump - print what a LightLora gateway forwards over the binary link
+// usage: hostlinkdump /dev/ttyACM0 [baud] [trace.bin]
+// SpiTrace dumps (HOSTLINK_SPITRACE) are appended to trace.bin for lorareplay
+#include <stdio.h>
+#include <stdlib.h>
+#include "HostLinkPort.h"
+
+static void PrintPacket(void* context, const HostLinkPacket& pkt)
+{
+	printf("%10u radio %u  %3u -> %3u  #%3u  rssi %4d dBm  snr %6.2f dB  fei %6d Hz  [%.*s]\n",
+		pkt.timeMs, pkt.radioId, pkt.srcAddress, pkt.dstAddress, pkt.srcLineCount,
+		pkt.rssi, pkt.snrQuarter * 0.25, pkt.freqError, (int)pkt.payLength, (const char*)pkt.payload);
+}
+
+static void PrintText(void* context, const std::string& line)
+{
+	printf("# %s\n", line.c_str());
+}
+
+static void SaveTrace(void* context, uint8_t frameType, const uint8_t* body, size_t len)
+{
+	if(frameType == HOSTLINK_SPITRACE && context != NULL)
+	{
+		fwrite(body, 1, len, (FILE*)context);
+		fflush((FILE*)context);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: %s device [baud] [trace.bin]\n", argv[0]);
+		return 2;
+	}
+	HostLinkPort port;
+	if(!port.Open(argv[1], (argc > 2) ? atoi(argv[2]) : 115200))
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	port.OnPacket(PrintPacket, NULL);
+	port.OnText(PrintText, NULL);
+	FILE* trace = NULL;
+	if(argc > 3)
+	{
+		trace = fopen(argv[3], "ab");
+		if(trace == NULL)
+		{
+			perror(argv[3]);
+			return 1;
+		}
+		port.OnOther(SaveTrace, trace);
+	}
+	while(port.Poll(250))
+	{
+		fflush(stdout);
+	}
+	fprintf(stderr, "port closed. %u good frames, %u bad\n", port.Decoder().GoodFrames(), port.Decoder().BadFrames());
+	if(trace)
+	{
+		fclose(trace);
+	}
+	return 0;
+}
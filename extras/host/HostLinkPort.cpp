@@ -0,0 +1,136 @@
+// --------------------------------------------------------------------
+// HostLinkPort reads COBS framed gateway output from a POSIX serial port
+// --------------------------------------------------------------------
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "HostLinkPort.h"
+
+HostLinkPort::HostLinkPort() : _Fd(-1), _PacketFn(NULL), _PacketContext(NULL), _TextFn(NULL), _TextContext(NULL),
+	_OtherFn(NULL), _OtherContext(NULL)
+{
+	_Decoder.SetHandler(HostLinkPort::FrameThunk, this);
+}
+
+HostLinkPort::~HostLinkPort()
+{
+	Close();
+}
+
+static speed_t BaudConstant(int baud)
+{
+	switch(baud)
+	{
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 921600: return B921600;
+		default: return B115200;
+	}
+}
+
+bool HostLinkPort::Open(const char* device, int baud)
+{
+	Close();
+	_Fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(_Fd < 0)
+	{
+		return false;
+	}
+	struct termios tio;
+	if(tcgetattr(_Fd, &tio) != 0)
+	{
+		Close();
+		return false;
+	}
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, BaudConstant(baud));
+	cfsetospeed(&tio, BaudConstant(baud));
+	tio.c_cflag |= CLOCAL | CREAD;
+	if(tcsetattr(_Fd, TCSANOW, &tio) != 0)
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void HostLinkPort::Close()
+{
+	if(_Fd >= 0)
+	{
+		close(_Fd);
+		_Fd = -1;
+	}
+}
+
+void HostLinkPort::OnPacket(HostPacketFn fn, void* context)
+{
+	_PacketFn = fn;
+	_PacketContext = context;
+}
+
+void HostLinkPort::OnText(HostTextFn fn, void* context)
+{
+	_TextFn = fn;
+	_TextContext = context;
+}
+
+void HostLinkPort::OnOther(HostLinkFrameFn fn, void* context)
+{
+	_OtherFn = fn;
+	_OtherContext = context;
+}
+
+bool HostLinkPort::Poll(int timeoutMs)
+{
+	if(_Fd < 0)
+	{
+		return false;
+	}
+	struct pollfd pfd;
+	pfd.fd = _Fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, timeoutMs) < 0)
+	{
+		return false;
+	}
+	if(pfd.revents & (POLLERR | POLLHUP))
+	{
+		return false;
+	}
+	uint8_t data[512];
+	ssize_t count;
+	while((count = read(_Fd, data, sizeof(data))) > 0)
+	{
+		_Decoder.Feed(data, count);
+	}
+	return true;
+}
+
+// decoder callback: sort frames by type
+void HostLinkPort::FrameThunk(void* context, uint8_t frameType, const uint8_t* body, size_t len)
+{
+	HostLinkPort* self = (HostLinkPort*)context;
+	if(frameType == HOSTLINK_PACKET && self->_PacketFn)
+	{
+		HostLinkPacket pkt;
+		if(HostLink::DecodePacket(body, len, pkt))
+		{
+			(*self->_PacketFn)(self->_PacketContext, pkt);
+		}
+	}
+	else if(frameType == HOSTLINK_TEXT && self->_TextFn)
+	{
+		(*self->_TextFn)(self->_TextContext, std::string((const char*)body, len));
+	}
+	else if(frameType != HOSTLINK_PACKET && frameType != HOSTLINK_TEXT && self->_OtherFn)
+	{
+		(*self->_OtherFn)(self->_OtherContext, frameType, body, len);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef HOST_LINK_PORT_H
+#define HOST_LINK_PORT_H
+
+// Host (Linux/POSIX) side of the LightLora binary gateway link.
+// Opens the gateway's USB serial port, runs the bytes through the same
+// HostLinkDecoder the firmware library uses and hands back decoded packets
+// and log lines. No text parsing on either end.
+// |	HostLinkPort port;
+// |	port.Open("/dev/ttyACM0", 115200);
+// |	port.OnPacket(myPacketFn, &state);
+// |	while(port.Poll(100)) ;
+// Build with the library codec, e.g.
+//   g++ -O2 -I../../src HostLinkDump.cpp HostLinkPort.cpp ../../src/HostLink.cpp -o hostlinkdump
+
+#include <string>
+#include "HostLink.h"
+
+typedef void (*HostPacketFn)(void* context, const HostLinkPacket& pkt);
+typedef void (*HostTextFn)(void* context, const std::string& line);
+
+class HostLinkPort
+{
+	public:
+		HostLinkPort();
+		~HostLinkPort();
+		bool Open(const char* device, int baud);	// raw 8N1, returns false on failure
+		void Close();
+		void OnPacket(HostPacketFn fn, void* context);
+		void OnText(HostTextFn fn, void* context);
+		void OnOther(HostLinkFrameFn fn, void* context);	// any other frame type (e.g. HOSTLINK_SPITRACE)
+		bool Poll(int timeoutMs);		// read what's there and dispatch. false if the port closed
+		const HostLinkDecoder& Decoder() const { return _Decoder; }
+
+	private:
+		static void FrameThunk(void* context, uint8_t frameType, const uint8_t* body, size_t len);
+
+		int _Fd;
+		HostLinkDecoder _Decoder;
+		HostPacketFn _PacketFn;
+		void* _PacketContext;
+		HostTextFn _TextFn;
+		void* _TextContext;
+		HostLinkFrameFn _OtherFn;
+		void* _OtherContext;
+};
+
+#endif // HOST_LINK_PORT_H
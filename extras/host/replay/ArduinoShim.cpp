@@ -0,0 +1,107 @@
+// --------------------------------------------------------------------
+// The host Arduino core for the replay harness
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "SPI.h"
+#include "SpiReplay.h"
+
+HostSerial Serial;
+SPIClass SPI;
+
+unsigned long millis(void)
+{
+	return SpiReplay::Instance().Now() / 1000;
+}
+
+unsigned long micros(void)
+{
+	return SpiReplay::Instance().Now();
+}
+
+void delay(unsigned long ms)
+{
+	SpiReplay::Instance().Advance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	SpiReplay::Instance().Advance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	SpiReplay::Instance().SetPin(pin, value ? HIGH : LOW);
+}
+
+int digitalRead(uint8_t pin)
+{
+	return SpiReplay::Instance().PinValue(pin);
+}
+
+void attachInterrupt(int interrupt, void (*handler)(void), int mode)
+{
+	SpiReplay::Instance().Attach(interrupt, handler);
+}
+
+void detachInterrupt(int interrupt)
+{
+	SpiReplay::Instance().Attach(interrupt, NULL);
+}
+
+void noInterrupts(void)
+{
+}
+
+void interrupts(void)
+{
+}
+
+// a fixed LCG so every run makes the same choices
+static unsigned long _RandomState = 1;
+
+void randomSeed(unsigned long seed)
+{
+	_RandomState = seed ? seed : 1;
+}
+
+long random(long howBig)
+{
+	if(howBig <= 0)
+	{
+		return 0;
+	}
+	_RandomState = _RandomState * 1103515245UL + 12345UL;
+	return (long)((_RandomState >> 16) & 0x7fff) % howBig;
+}
+
+long random(long howSmall, long howBig)
+{
+	if(howSmall >= howBig)
+	{
+		return howSmall;
+	}
+	return howSmall + random(howBig - howSmall);
+}
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+	SpiReplay::Instance().BeginTransaction();
+}
+
+void SPIClass::endTransaction()
+{
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	return data;		// the driver only uses the buffer form
+}
+
+void SPIClass::transfer(void* buffer, size_t count)
+{
+	SpiReplay::Instance().Transfer((uint8_t*)buffer, count);
+}
@@ -0,0 +1,65 @@
+// lorareplay - run the LightLora driver against a captured SPI trace
+// usage: lorareplay trace.bin [ssPin rstPin dio0Pin] [-v]
+// The trace should start at power up (LoraUtil::SetSpiTrace before Initialize,
+// then SpiTrace::DumpToHost and collect the HOSTLINK_SPITRACE frames).
+// Prints each packet the driver decodes, how many SPI transactions init and each
+// packet took, and how far the driver strayed from the recording.
+// Build from this directory with
+//   g++ -O2 -Iarduino -I../../../src LoraReplay.cpp SpiReplay.cpp ArduinoShim.cpp ../../../src/*.cpp -o lorareplay
+#include "Arduino.h"
+#include "SpiReplay.h"
+#include "LoraUtil.h"
+#include "SerialWrap.h"
+
+int main(int argc, char** argv)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "usage: %s trace.bin [ssPin rstPin dio0Pin] [-v]\n", argv[0]);
+		return 2;
+	}
+	int pinSS = 8;			// Feather M0 LoRa, as in FeatherLora.ino
+	int pinRST = 4;
+	int pinDIO0 = 3;
+	bool verbose = (strcmp(argv[argc - 1], "-v") == 0);
+	if(argc >= 5)
+	{
+		pinSS = atoi(argv[2]);
+		pinRST = atoi(argv[3]);
+		pinDIO0 = atoi(argv[4]);
+	}
+
+	SpiReplay& replay = SpiReplay::Instance();
+	if(!replay.Load(argv[1]))
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	replay.SetVerbose(verbose);
+	replay.MapDio(0, pinDIO0);
+
+	LoraUtil lru(pinSS, pinRST, pinDIO0, NULL);
+	ASeries.Drain();
+	printf("init: %u spi transactions\n", replay.Transactions());
+
+	int packets = 0;
+	uint32_t mark = replay.Transactions();
+	while(replay.Pump())
+	{
+		if(lru.IsPacketAvailable())
+		{
+			LoraPacket* pkt = lru.ReadPacket();
+			printf("%10u  %3u -> %3u  #%3u  rssi %4d  snr %6.2f  spi %u  [%s]\n",
+				pkt->rxTime, pkt->srcAddress, pkt->dstAddress, pkt->srcLineCount,
+				pkt->rssi, pkt->snr, replay.Transactions() - mark, pkt->msgTxt.c_str());
+			delete pkt;
+			packets++;
+		}
+		mark = replay.Transactions();
+		ASeries.Drain();
+	}
+	ASeries.Drain();
+	printf("%d packets, %u transactions, %u divergences, %u recorded transfers skipped\n",
+		packets, replay.Transactions(), replay.Divergences(), replay.Skipped());
+	return replay.Divergences() ? 3 : 0;
+}
@@ -0,0 +1,202 @@
+// --------------------------------------------------------------------
+// SpiReplay - serves a recorded SpiTrace back to the driver
+// --------------------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include "SpiReplay.h"
+#include "SpiTrace.h"
+
+SpiReplay& SpiReplay::Instance()
+{
+	static SpiReplay replay;
+	return replay;
+}
+
+SpiReplay::SpiReplay() : _At(0), _Now(0), _InIrq(false), _Verbose(false)
+{
+	for(int i = 0; i < REPLAY_MAX_DIO; i++)
+	{
+		_DioPin[i] = -1;
+	}
+	memset(_Handlers, 0, sizeof(_Handlers));
+	memset(_Pins, 0, sizeof(_Pins));
+	memset(_Shadow, 0, sizeof(_Shadow));
+	ResetCounts();
+}
+
+bool SpiReplay::Load(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if(f == NULL)
+	{
+		return false;
+	}
+	std::vector<uint8_t> data;
+	uint8_t chunk[4096];
+	size_t n;
+	while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+	{
+		data.insert(data.end(), chunk, chunk + n);
+	}
+	fclose(f);
+	Load(data.data(), data.size());
+	return true;
+}
+
+void SpiReplay::Load(const uint8_t* data, size_t len)
+{
+	_Trace.assign(data, data + len);
+	_At = 0;
+	_Now = 0;
+}
+
+void SpiReplay::MapDio(uint8_t dioLine, int pin)
+{
+	if(dioLine < REPLAY_MAX_DIO)
+	{
+		_DioPin[dioLine] = pin;
+	}
+}
+
+void SpiReplay::ResetCounts()
+{
+	_Transactions = 0;
+	_Divergences = 0;
+	_Skipped = 0;
+}
+
+void SpiReplay::Attach(int pin, void (*handler)(void))
+{
+	_Handlers[pin & 0xff] = handler;
+}
+
+bool SpiReplay::Finished() const
+{
+	return _At + SPITRACE_HEADER > _Trace.size();
+}
+
+bool SpiReplay::NextIs(uint8_t kind) const
+{
+	return !Finished() && _Trace[_At] == kind;
+}
+
+static uint32_t RecordTime(const uint8_t* rec)
+{
+	return rec[3] | (rec[4] << 8) | (rec[5] << 16) | ((uint32_t)rec[6] << 24);
+}
+
+// consume an IRQ record and call whoever is attached to that DIO line
+void SpiReplay::FireIrq()
+{
+	const uint8_t* rec = &_Trace[_At];
+	uint8_t line = rec[1];
+	_At += SPITRACE_HEADER;
+	_Now = (RecordTime(rec) > _Now) ? RecordTime(rec) : _Now;
+	int pin = (line < REPLAY_MAX_DIO) ? _DioPin[line] : -1;
+	if(pin < 0 || _Handlers[pin] == NULL)
+	{
+		if(_Verbose)
+		{
+			printf("replay: irq on DIO%d but nothing attached\n", line);
+		}
+		return;
+	}
+	_InIrq = true;
+	(*_Handlers[pin])();
+	_InIrq = false;
+}
+
+bool SpiReplay::Pump(bool skipTransfers)
+{
+	while(!Finished())
+	{
+		if(NextIs(SPITRACE_IRQ))
+		{
+			FireIrq();
+			return true;
+		}
+		if(!skipTransfers)
+		{
+			return true;
+		}
+		// recorded loop traffic that this harness isn't generating
+		_At += SPITRACE_HEADER + _Trace[_At + 2];
+		_Skipped++;
+	}
+	return false;
+}
+
+// interrupts get in between transactions, never inside one
+void SpiReplay::BeginTransaction()
+{
+	if(!_InIrq && NextIs(SPITRACE_IRQ))
+	{
+		FireIrq();
+	}
+}
+
+// buffer is [address][data...] exactly as the driver clocks it out
+void SpiReplay::Transfer(uint8_t* buffer, size_t count)
+{
+	_Transactions++;
+	if(count < 1)
+	{
+		return;
+	}
+	uint8_t address = buffer[0];
+	uint8_t reg = address & 0x7f;
+	size_t len = count - 1;
+	bool isWrite = (address & 0x80) != 0;
+	bool matches = NextIs(SPITRACE_XFER) && _Trace[_At + 1] == address && _Trace[_At + 2] == len;
+	if(matches)
+	{
+		const uint8_t* rec = &_Trace[_At];
+		const uint8_t* data = rec + SPITRACE_HEADER;
+		_Now = (RecordTime(rec) > _Now) ? RecordTime(rec) : _Now;
+		_At += SPITRACE_HEADER + len;
+		if(isWrite)
+		{
+			if(memcmp(buffer + 1, data, len) != 0)
+			{
+				_Divergences++;
+				if(_Verbose)
+				{
+					printf("replay: write to 0x%02x differs from the trace\n", reg);
+				}
+			}
+			if(len > 0)
+			{
+				buffer[1] = _Shadow[reg];	// a write returns the previous value
+				_Shadow[reg] = data[len - 1];
+			}
+		}
+		else
+		{
+			memcpy(buffer + 1, data, len);
+			if(len > 0)
+			{
+				_Shadow[reg] = data[len - 1];
+			}
+		}
+		return;
+	}
+
+	// the driver did something the recording didn't
+	_Divergences++;
+	if(_Verbose)
+	{
+		printf("replay: unexpected %s of 0x%02x (%d bytes) at record offset %u\n",
+			isWrite ? "write" : "read", reg, (int)len, (unsigned)_At);
+	}
+	if(isWrite)
+	{
+		if(len > 0)
+		{
+			_Shadow[reg] = buffer[len];
+		}
+	}
+	else
+	{
+		memset(buffer + 1, _Shadow[reg], len);
+	}
+}
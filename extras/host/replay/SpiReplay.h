@@ -0,0 +1,62 @@
+#ifndef SPI_REPLAY_H
+#define SPI_REPLAY_H
+
+// Deterministic replay of a recorded SpiTrace against the real driver code.
+// The SPI shim asks this for every transfer: reads are answered from the trace,
+// writes are checked against it. IRQ records fire the attached handler at the
+// next transaction boundary (or from Pump), the same place the real SPI
+// interrupt lockout would let them in. The clock follows the trace timestamps.
+// Any transfer that doesn't match the recording is counted as a divergence and
+// answered from a shadow copy of the registers so the run can continue.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define REPLAY_MAX_DIO 6
+
+class SpiReplay
+{
+	public:
+		static SpiReplay& Instance();
+		bool Load(const char* path);				// a file of concatenated SpiTrace records
+		void Load(const uint8_t* data, size_t len);
+		void MapDio(uint8_t dioLine, int pin);		// which interrupt pin a DIO line is wired to
+		bool Pump(bool skipTransfers = true);		// deliver the next interrupt. false at end of trace
+		bool Finished() const;
+		// statistics
+		uint32_t Transactions() const { return _Transactions; }	// transfers the driver issued
+		uint32_t Divergences() const { return _Divergences; }		// transfers that didn't match
+		uint32_t Skipped() const { return _Skipped; }				// recorded transfers nobody issued
+		void ResetCounts();
+		void SetVerbose(bool isVerbose) { _Verbose = isVerbose; }
+
+		// for the Arduino shim
+		uint32_t Now() const { return _Now; }
+		void Advance(uint32_t us) { _Now += us; }
+		void Attach(int pin, void (*handler)(void));
+		void BeginTransaction();
+		void Transfer(uint8_t* buffer, size_t count);
+		uint8_t PinValue(uint8_t pin) const { return _Pins[pin]; }
+		void SetPin(uint8_t pin, uint8_t value) { _Pins[pin] = value; }
+
+	private:
+		SpiReplay();
+		bool NextIs(uint8_t kind) const;
+		void FireIrq();
+
+		std::vector<uint8_t> _Trace;
+		size_t _At;					// next record
+		uint32_t _Now;				// replay clock in microseconds
+		int _DioPin[REPLAY_MAX_DIO];
+		void (*_Handlers[256])(void);
+		uint8_t _Pins[256];
+		uint8_t _Shadow[128];		// last known register values
+		bool _InIrq;
+		bool _Verbose;
+		uint32_t _Transactions;
+		uint32_t _Divergences;
+		uint32_t _Skipped;
+};
+
+#endif // SPI_REPLAY_H
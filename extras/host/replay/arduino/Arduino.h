@@ -0,0 +1,138 @@
+#ifndef REPLAY_ARDUINO_H
+#define REPLAY_ARDUINO_H
+
+// Just enough of the Arduino core to run the LightLora sources on a host
+// against a recorded SPI trace (see SpiReplay.h). Time, pins and interrupts
+// are all driven by the replay so a run is fully deterministic.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>	// before the min/max macros below
+
+#define LIGHTLORA_HOST 1	// no real interrupts, see IrqGuard.h
+
+#define DEC 10
+#define HEX 16
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define MSBFIRST 1
+#define LSBFIRST 0
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+// the subset of Arduino String the library uses, over std::string
+class String
+{
+	public:
+		String(const char* text = "") : _S(text ? text : "") {}
+		String(const std::string& text) : _S(text) {}
+		String(char c) : _S(1, c) {}
+		String(int value, int base = DEC) { Format((long)value, base); }
+		String(unsigned int value, int base = DEC) { FormatU(value, base); }
+		String(long value, int base = DEC) { Format(value, base); }
+		String(unsigned long value, int base = DEC) { FormatU(value, base); }
+		String(float value, int places = 2) { FormatF(value, places); }
+		String(double value, int places = 2) { FormatF(value, places); }
+		const char* c_str() const { return _S.c_str(); }
+		unsigned int length() const { return (unsigned int)_S.size(); }
+		bool reserve(unsigned int size) { _S.reserve(size); return true; }
+		void toCharArray(char* buf, unsigned int size) const
+		{
+			if(size == 0) return;
+			size_t n = _S.size() < size - 1 ? _S.size() : size - 1;
+			memcpy(buf, _S.data(), n);
+			buf[n] = 0;
+		}
+		char operator[](unsigned int index) const { return index < _S.size() ? _S[index] : 0; }
+		String& operator+=(const String& rhs) { _S += rhs._S; return *this; }
+		String& operator+=(const char* rhs) { _S += rhs; return *this; }
+		String& operator+=(char rhs) { _S += rhs; return *this; }
+		bool operator==(const String& rhs) const { return _S == rhs._S; }
+		bool operator==(const char* rhs) const { return _S == rhs; }
+		bool operator!=(const String& rhs) const { return _S != rhs._S; }
+		friend String operator+(const String& lhs, const String& rhs) { return String(lhs._S + rhs._S); }
+		friend String operator+(const String& lhs, const char* rhs) { return String(lhs._S + rhs); }
+		friend String operator+(const char* lhs, const String& rhs) { return String(lhs + rhs._S); }
+
+	private:
+		void Format(long value, int base) { char t[40]; snprintf(t, sizeof(t), base == HEX ? "%lx" : "%ld", value); _S = t; }
+		void FormatU(unsigned long value, int base) { char t[40]; snprintf(t, sizeof(t), base == HEX ? "%lx" : "%lu", value); _S = t; }
+		void FormatF(double value, int places) { char t[64]; snprintf(t, sizeof(t), "%.*f", places, value); _S = t; }
+		std::string _S;
+};
+
+class Print
+{
+	public:
+		virtual ~Print() {}
+		virtual size_t write(uint8_t value) = 0;
+		virtual size_t write(const uint8_t* buffer, size_t size)
+		{
+			size_t n = 0;
+			while(size--) n += write(*buffer++);
+			return n;
+		}
+		size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+		virtual int availableForWrite() { return 0; }
+		size_t print(const String& text) { return write((const uint8_t*)text.c_str(), text.length()); }
+		size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+		size_t print(int value, int base = DEC) { return print(String(value, base)); }
+		size_t println(const String& text) { return print(text) + print("\r\n"); }
+		size_t println(const char* text = "") { return print(text) + print("\r\n"); }
+		size_t println(int value, int base = DEC) { return print(value, base) + print("\r\n"); }
+};
+
+// Serial goes to stdout, never blocks
+class HostSerial : public Print
+{
+	public:
+		operator bool() { return true; }
+		void begin(unsigned long baud) {}
+		int available() { return 0; }
+		int read() { return -1; }
+		void flush() { fflush(stdout); }
+		int availableForWrite() { return 4096; }
+		size_t write(uint8_t value) { return fwrite(&value, 1, 1, stdout); }
+		size_t write(const uint8_t* buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+};
+extern HostSerial Serial;
+
+// time is the replay clock
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// pins
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int interrupt, void (*handler)(void), int mode);
+void detachInterrupt(int interrupt);
+void noInterrupts(void);
+void interrupts(void);
+
+// deterministic pseudo random
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+#endif // REPLAY_ARDUINO_H
@@ -0,0 +1,29 @@
+#ifndef REPLAY_SPI_H
+#define REPLAY_SPI_H
+
+// SPI for the replay harness: transfers are answered from the loaded trace
+#include "Arduino.h"
+
+#define SPI_MODE0 0x00
+
+class SPISettings
+{
+	public:
+		SPISettings() {}
+		SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) {}
+};
+
+class SPIClass
+{
+	public:
+		void begin() {}
+		void end() {}
+		void usingInterrupt(int interruptNumber) {}
+		void beginTransaction(SPISettings settings);
+		void endTransaction();
+		uint8_t transfer(uint8_t data);
+		void transfer(void* buffer, size_t count);
+};
+extern SPIClass SPI;
+
+#endif // REPLAY_SPI_H
@@ -0,0 +1,462 @@
+// --------------------------------------------------------------------
+// BulkTransfer is the fragment / block ack protocol for LoraUtil::SendBulk
+// One transfer each way at a time. The interrupt side (OnControl) only
+// copies and flags; callbacks run from Service in the loop
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "BulkTransfer.h"
+#include "IrqGuard.h"
+
+static uint32_t WindowMask(int count)
+{
+	return (count >= 32) ? 0xffffffff : (((uint32_t)1 << count) - 1);
+}
+
+BulkTransfer::BulkTransfer()
+{
+	_TxState = BULK_IDLE;
+	_TxId = 0;
+	_TxCancelOwed = false;
+	_TxAckIn = false;
+	_TxCancelIn = false;
+	_Reader = NULL;
+	_ReaderContext = NULL;
+	memset(&_RxInfo, 0, sizeof(_RxInfo));
+	_RxStartOwed = false;
+	_RxAckOwed = false;
+	_RxCancelOwed = false;
+	_RxCancelIn = false;
+	for(int i = 0; i < BULK_RX_BUFFERS; i++)
+	{
+		_RxBufFull[i] = false;
+	}
+	_Writer = NULL;
+	_WriterContext = NULL;
+}
+
+bool BulkTransfer::Start(uint8_t dstAddress, uint32_t size, BulkReader reader, void* context, uint8_t fragmentSize)
+{
+	if(_TxState == BULK_ACTIVE || reader == NULL || size == 0)
+	{
+		return false;
+	}
+	fragmentSize = min(max((int)fragmentSize, 1), BULK_FRAGMENT_MAX);
+	uint32_t count = (size + fragmentSize - 1) / fragmentSize;
+	if(count > 0xffff)
+	{
+		return false;
+	}
+	_TxDst = dstAddress;
+	_TxId++;
+	_TxFragment = fragmentSize;
+	_TxSize = size;
+	_TxCount = count;
+	_TxBase = 0;
+	_TxAcked = 0;
+	_TxSent = 0;
+	_TxRetries = 0;
+	_TxStarted = false;
+	_TxWaiting = false;
+	_TxWaitMs = 0;
+	_TxAckIn = false;
+	_TxCancelIn = false;
+	_TxCancelOwed = false;
+	_Reader = reader;
+	_ReaderContext = context;
+	_TxState = BULK_ACTIVE;
+	return true;
+}
+
+// transfer ids start from here, so they differ from the last boot's
+void BulkTransfer::SeedId(uint8_t seed)
+{
+	if(_TxState != BULK_ACTIVE)
+	{
+		_TxId = seed;
+	}
+}
+
+uint8_t BulkTransfer::SendStatus()
+{
+	return _TxState;
+}
+
+uint32_t BulkTransfer::BytesAcked()
+{
+	return min((uint32_t)_TxBase * _TxFragment, _TxSize);
+}
+
+// the buffers are allocated here so the interrupt never does
+void BulkTransfer::SetWriter(BulkWriter writer, void* context)
+{
+	for(int i = 0; i < BULK_RX_BUFFERS; i++)
+	{
+		_RxBuf[i].Allocate(BULK_FRAGMENT_MAX, 1);
+	}
+	_WriterContext = context;
+	_Writer = writer;
+}
+
+uint8_t BulkTransfer::ReceiveStatus()
+{
+	return _RxInfo.status;
+}
+
+void BulkTransfer::OnControl(uint8_t srcAddress, const uint8_t* body, int length)
+{
+	bool isRx = (srcAddress == _RxInfo.peerAddress && length > 1 && body[1] == _RxInfo.transferId);
+	bool isTx = (_TxState == BULK_ACTIVE && srcAddress == _TxDst && length > 1 && body[1] == _TxId);
+	switch(body[0])
+	{
+		case LORA_CTRL_BULK_START:
+			if(length < 7 || _Writer == NULL || body[6] == 0 || body[6] > BULK_FRAGMENT_MAX)
+			{
+				return;
+			}
+		{
+			uint32_t size = body[2] | ((uint32_t)body[3] << 8) | ((uint32_t)body[4] << 16) | ((uint32_t)body[5] << 24);
+			if(isRx && _RxInfo.status == BULK_ACTIVE && size == _RxInfo.totalSize && body[6] == _RxFragment)
+			{
+				_RxAckOwed = true;		// our accept was lost
+				return;
+			}
+			// anything else is a new transfer, even with the last one's id: the sender may
+			// have rebooted or wrapped its ids, and acking with the old progress would lose data
+			if(_RxInfo.status == BULK_ACTIVE && srcAddress != _RxInfo.peerAddress && (millis() - _RxLast) < BULK_IDLE_MS)
+			{
+				return;		// busy with someone else, they'll retry
+			}
+			_RxInfo.peerAddress = srcAddress;
+			_RxInfo.transferId = body[1];
+			_RxInfo.totalSize = size;
+			_RxInfo.status = BULK_ACTIVE;
+			_RxFragment = body[6];
+			_RxCount = (_RxInfo.totalSize + _RxFragment - 1) / _RxFragment;
+			_RxBase = 0;
+			_RxMask = 0;
+			for(int i = 0; i < BULK_RX_BUFFERS; i++)
+			{
+				_RxBufFull[i] = false;
+			}
+			_RxLast = millis();
+			_RxStartOwed = true;
+			_RxAckOwed = true;
+			break;
+		}
+		case LORA_CTRL_BULK_DATA:
+		{
+			if(length < 5 || !isRx || _RxInfo.status == BULK_IDLE || _RxInfo.status == BULK_FAILED)
+			{
+				return;
+			}
+			_RxLast = millis();
+			uint16_t index = body[3] | (body[4] << 8);
+			uint16_t ahead = index - _RxBase;
+			int size = length - 5;
+			if(_RxInfo.status == BULK_ACTIVE && index < _RxCount && ahead < 32 && size <= _RxFragment &&
+				(_RxMask & ((uint32_t)1 << ahead)) == 0)
+			{
+				int slot = -1;
+				for(int i = 0; i < BULK_RX_BUFFERS; i++)
+				{
+					if(_RxBufFull[i] && _RxBufIndex[i] == index)
+					{
+						slot = -1;		// already have it
+						break;
+					}
+					if(!_RxBufFull[i] && slot < 0)
+					{
+						slot = i;
+					}
+				}
+				if(slot >= 0)
+				{
+					_RxBuf[slot].Allocate(size);		// never bigger than SetWriter made it
+					memcpy(_RxBuf[slot].Data(), body + 5, size);
+					_RxBufIndex[slot] = index;
+					_RxBufFull[slot] = true;
+				}
+				// else the loop is behind, drop it and it gets resent
+			}
+			if(body[2] & BULK_FLAG_POLL)
+			{
+				_RxAckOwed = true;
+			}
+			break;
+		}
+		case LORA_CTRL_BULK_ACK:
+			if(length >= 8 && isTx)
+			{
+				_TxAckBase = body[2] | (body[3] << 8);
+				_TxAckMask = body[4] | ((uint32_t)body[5] << 8) | ((uint32_t)body[6] << 16) | ((uint32_t)body[7] << 24);
+				_TxAckIn = true;
+			}
+			break;
+		case LORA_CTRL_BULK_CANCEL:
+			if(isTx)
+			{
+				_TxCancelIn = true;
+			}
+			if(isRx && _RxInfo.status == BULK_ACTIVE)
+			{
+				_RxCancelIn = true;
+			}
+			break;
+	}
+}
+
+void BulkTransfer::Service(uint32_t now)
+{
+	// receiver
+	if(_RxInfo.status == BULK_ACTIVE)
+	{
+		if(_RxCancelIn)
+		{
+			_RxCancelIn = false;
+			EndReceive(BULK_FAILED);
+		}
+		else if(_RxStartOwed)
+		{
+			_RxStartOwed = false;
+			Notify(BULK_ACTIVE);
+		}
+	}
+	if(_RxInfo.status == BULK_ACTIVE)
+	{
+		for(int i = 0; i < BULK_RX_BUFFERS; i++)
+		{
+			if(!_RxBufFull[i])
+			{
+				continue;
+			}
+			uint16_t ahead = _RxBufIndex[i] - _RxBase;
+			if(ahead < 32 && (_RxMask & ((uint32_t)1 << ahead)) == 0)
+			{
+				uint32_t offset = (uint32_t)_RxBufIndex[i] * _RxFragment;
+				if(!_Writer(_WriterContext, _RxInfo, offset, _RxBuf[i].Data(), _RxBuf[i].Size()))
+				{
+					_RxCancelOwed = true;
+					EndReceive(BULK_FAILED);
+					break;
+				}
+				_RxMask |= (uint32_t)1 << ahead;
+			}
+			_RxBufFull[i] = false;
+		}
+		while(_RxMask & 1)
+		{
+			_RxMask >>= 1;
+			_RxBase++;
+		}
+		if(_RxInfo.status == BULK_ACTIVE)
+		{
+			uint32_t rxLast;
+			{
+				IrqGuard guard;		// four bytes the interrupt may be writing
+				rxLast = _RxLast;
+			}
+			if(_RxBase >= _RxCount)
+			{
+				EndReceive(BULK_DONE);
+			}
+			else if((now - rxLast) > BULK_IDLE_MS)
+			{
+				EndReceive(BULK_FAILED);
+			}
+		}
+	}
+
+	// sender
+	if(_TxState != BULK_ACTIVE)
+	{
+		return;
+	}
+	if(_TxCancelIn)
+	{
+		_TxState = BULK_FAILED;
+		return;
+	}
+	// take the ack as a whole, a newer one may land between the fields
+	bool ackIn;
+	uint16_t base;
+	uint32_t mask;
+	{
+		IrqGuard guard;
+		ackIn = _TxAckIn;
+		base = _TxAckBase;
+		mask = _TxAckMask;
+		_TxAckIn = false;
+	}
+	if(ackIn)
+	{
+		if((int16_t)(base - _TxBase) >= 0)
+		{
+			_TxBase = base;
+			_TxAcked = mask;
+		}
+		_TxStarted = true;
+		_TxWaiting = false;
+		_TxSent = 0;			// anything sent and not acked was lost
+		_TxRetries = 0;
+		if(_TxBase >= _TxCount)
+		{
+			_TxState = BULK_DONE;
+		}
+	}
+	else if(_TxWaiting && (now - _TxWaitStart) > _TxWaitMs)
+	{
+		if(++_TxRetries > BULK_MAX_RETRIES)
+		{
+			FailSend();
+			return;
+		}
+		// the poll or its ack was lost: resend just the first missing fragment, as a poll
+		_TxWaiting = false;
+		if(_TxStarted)
+		{
+			int window = min(BULK_WINDOW, _TxCount - _TxBase);
+			uint32_t missing = ~_TxAcked & WindowMask(window);
+			_TxSent = missing & (missing - 1);
+		}
+	}
+}
+
+int BulkTransfer::NextFrame(uint32_t now, uint8_t& dstAddress, uint8_t* body)
+{
+	// receiver first, the sender is waiting on us
+	if(_RxCancelOwed)
+	{
+		_RxCancelOwed = false;
+		dstAddress = _RxInfo.peerAddress;
+		body[0] = LORA_CTRL_BULK_CANCEL;
+		body[1] = _RxInfo.transferId;
+		return 2;
+	}
+	if(_RxAckOwed && !_RxStartOwed)
+	{
+		bool drained = true;
+		for(int i = 0; i < BULK_RX_BUFFERS; i++)
+		{
+			drained = drained && !_RxBufFull[i];
+		}
+		if(drained)
+		{
+			_RxAckOwed = false;
+			dstAddress = _RxInfo.peerAddress;
+			return BuildAck(body);
+		}
+	}
+	if(_TxCancelOwed)
+	{
+		_TxCancelOwed = false;
+		dstAddress = _TxDst;
+		body[0] = LORA_CTRL_BULK_CANCEL;
+		body[1] = _TxId;
+		return 2;
+	}
+	if(_TxState != BULK_ACTIVE || _TxWaiting || _TxAckIn)
+	{
+		return 0;
+	}
+	dstAddress = _TxDst;
+	if(!_TxStarted)
+	{
+		body[0] = LORA_CTRL_BULK_START;
+		body[1] = _TxId;
+		for(int i = 0; i < 4; i++)
+		{
+			body[2 + i] = (_TxSize >> (8 * i)) & 0xff;
+		}
+		body[6] = _TxFragment;
+		_TxWaiting = true;
+		return 7;
+	}
+	int window = min(BULK_WINDOW, _TxCount - _TxBase);
+	uint32_t full = WindowMask(window);
+	uint32_t done = _TxAcked | _TxSent;
+	for(int n = 0; n < window; n++)
+	{
+		uint32_t bit = (uint32_t)1 << n;
+		if(done & bit)
+		{
+			continue;
+		}
+		bool last = ((done | bit) & full) == full;		// nothing after it left to send
+		int length = BuildData(_TxBase + n, last ? BULK_FLAG_POLL : 0, body);
+		if(length < 0)
+		{
+			FailSend();
+			return 0;
+		}
+		_TxSent |= bit;
+		_TxWaiting = last;
+		return length;
+	}
+	return 0;
+}
+
+void BulkTransfer::FrameSent(uint32_t now, uint32_t waitMs)
+{
+	_TxWaitStart = now;
+	_TxWaitMs = waitMs;
+}
+
+int BulkTransfer::BuildAck(uint8_t* body)
+{
+	body[0] = LORA_CTRL_BULK_ACK;
+	body[1] = _RxInfo.transferId;
+	body[2] = _RxBase & 0xff;
+	body[3] = _RxBase >> 8;
+	for(int i = 0; i < 4; i++)
+	{
+		body[4 + i] = (_RxMask >> (8 * i)) & 0xff;
+	}
+	return 8;
+}
+
+int BulkTransfer::BuildData(uint16_t index, uint8_t flags, uint8_t* body)
+{
+	uint32_t offset = (uint32_t)index * _TxFragment;
+	int length = min((uint32_t)_TxFragment, _TxSize - offset);
+	if(_Reader(_ReaderContext, offset, body + 5, length) != length)
+	{
+		return -1;
+	}
+	body[0] = LORA_CTRL_BULK_DATA;
+	body[1] = _TxId;
+	body[2] = flags;
+	body[3] = index & 0xff;
+	body[4] = index >> 8;
+	return 5 + length;
+}
+
+void BulkTransfer::FailSend()
+{
+	_TxState = BULK_FAILED;
+	_TxCancelOwed = true;
+}
+
+void BulkTransfer::EndReceive(uint8_t status)
+{
+	_RxInfo.status = status;
+	for(int i = 0; i < BULK_RX_BUFFERS; i++)
+	{
+		_RxBufFull[i] = false;
+	}
+	if(status == BULK_DONE)
+	{
+		_RxAckOwed = true;		// the final ack finishes the sender
+	}
+	Notify(status);
+}
+
+// a status change, length 0. A writer that refuses the start cancels the transfer
+void BulkTransfer::Notify(uint8_t status)
+{
+	uint32_t offset = min((uint32_t)_RxBase * _RxFragment, _RxInfo.totalSize);		// bytes written in order
+	if(_Writer != NULL && !_Writer(_WriterContext, _RxInfo, offset, NULL, 0) && status == BULK_ACTIVE)
+	{
+		_RxCancelOwed = true;
+		EndReceive(BULK_FAILED);
+	}
+}
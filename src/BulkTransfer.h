@@ -0,0 +1,120 @@
+#ifndef BULK_TRANSFER_H
+#define BULK_TRANSFER_H
+
+#include "TinyVector.h"
+
+// Moves objects bigger than a packet (config blobs, firmware images) as a
+// numbered series of fragments. The sender sends up to BULK_WINDOW fragments
+// back to back, the last one asking for a block ack. The ack is the receiver's
+// window (everything below base plus a bitmap), so only the gaps are resent.
+// Neither side holds the object: the sender reads fragments through a callback
+// and the receiver writes them, in any order, through another.
+// This class is only the protocol. LoraUtil sends the frames it builds and
+// passes it the control packets it gets.
+
+#ifndef BULK_WINDOW
+#define BULK_WINDOW 16				// fragments per block ack, at most 32
+#endif
+#define BULK_FRAGMENT_SIZE 240		// default data bytes per fragment
+#define BULK_FRAGMENT_MAX 246		// what fits in a packet after the headers
+#define BULK_FRAME_MAX 255			// largest control body we build
+#define BULK_RX_BUFFERS 2			// fragments held between the interrupt and the writer
+#define BULK_MAX_RETRIES 5			// ack timeouts in a row before giving up
+#define BULK_IDLE_MS 20000			// receiver gives up after this long without a fragment
+
+// control opcodes, carried as LoraUtil control packets
+#define LORA_CTRL_BULK_START 5		// [id][size, 4 bytes lsb first][fragment size]
+#define LORA_CTRL_BULK_DATA 6		// [id][flags][index lsb][index msb][data]
+#define LORA_CTRL_BULK_ACK 7		// [id][base lsb][base msb][mask, 4 bytes lsb first]
+#define LORA_CTRL_BULK_CANCEL 8		// [id]
+#define BULK_FLAG_POLL 1			// data flag: ack after this one
+
+enum BulkStatus
+{
+	BULK_IDLE = 0,
+	BULK_ACTIVE,
+	BULK_DONE,
+	BULK_FAILED
+};
+
+class BulkInfo
+{
+	public:
+		uint8_t peerAddress;
+		uint8_t transferId;
+		uint8_t status;				// BulkStatus
+		uint32_t totalSize;
+};
+
+// sender: fill buffer with length bytes from offset. Return the count, or -1 to abort
+typedef int (*BulkReader)(void* context, uint32_t offset, uint8_t* buffer, int length);
+// receiver: store length bytes at offset. Called with length 0 when the status
+// changes (active at the start, then done or failed). Return false to abort
+typedef bool (*BulkWriter)(void* context, const BulkInfo& info, uint32_t offset, const uint8_t* data, int length);
+
+class BulkTransfer
+{
+	public:
+		BulkTransfer();
+		// sender
+		bool Start(uint8_t dstAddress, uint32_t size, BulkReader reader, void* context, uint8_t fragmentSize = BULK_FRAGMENT_SIZE);
+		void SeedId(uint8_t seed);	// something random, at startup
+		uint8_t SendStatus();		// BulkStatus
+		uint32_t BytesAcked();
+		// receiver
+		void SetWriter(BulkWriter writer, void* context);
+		uint8_t ReceiveStatus();	// BulkStatus
+		// from LoraUtil
+		void OnControl(uint8_t srcAddress, const uint8_t* body, int length);	// interrupt time
+		void Service(uint32_t now);		// writes buffered fragments, handles acks and timeouts
+		int NextFrame(uint32_t now, uint8_t& dstAddress, uint8_t* body);	// control body to send, 0 if none
+		void FrameSent(uint32_t now, uint32_t waitMs);		// how long to wait for an ack to it
+
+	private:
+		int BuildAck(uint8_t* body);
+		int BuildData(uint16_t index, uint8_t flags, uint8_t* body);
+		void FailSend();
+		void EndReceive(uint8_t status);
+		void Notify(uint8_t status);
+
+		// sender
+		uint8_t _TxState;			// BulkStatus
+		bool _TxStarted;			// the receiver accepted
+		bool _TxWaiting;			// we polled, waiting for the ack
+		bool _TxCancelOwed;
+		uint8_t _TxDst;
+		uint8_t _TxId;
+		uint8_t _TxFragment;
+		uint8_t _TxRetries;
+		uint32_t _TxSize;
+		uint16_t _TxCount;			// fragments
+		uint16_t _TxBase;			// every fragment below this is acked
+		uint32_t _TxAcked;			// bit n is _TxBase + n
+		uint32_t _TxSent;			// sent since the last ack, same bits
+		uint32_t _TxWaitStart;
+		uint32_t _TxWaitMs;
+		BulkReader _Reader;
+		void* _ReaderContext;
+		volatile bool _TxAckIn;		// from the interrupt
+		volatile uint16_t _TxAckBase;
+		volatile uint32_t _TxAckMask;
+		volatile bool _TxCancelIn;
+		// receiver
+		BulkInfo _RxInfo;
+		uint8_t _RxFragment;
+		uint16_t _RxCount;
+		uint16_t _RxBase;			// every fragment below this is written
+		uint32_t _RxMask;			// bit n is _RxBase + n
+		volatile uint32_t _RxLast;	// millis() of the last frame
+		volatile bool _RxStartOwed;	// tell the writer
+		volatile bool _RxAckOwed;
+		volatile bool _RxCancelOwed;
+		volatile bool _RxCancelIn;
+		TinyVector _RxBuf[BULK_RX_BUFFERS];
+		volatile uint16_t _RxBufIndex[BULK_RX_BUFFERS];
+		volatile bool _RxBufFull[BULK_RX_BUFFERS];
+		BulkWriter _Writer;
+		void* _WriterContext;
+};
+
+#endif // BULK_TRANSFER_H
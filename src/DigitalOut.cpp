@@ -1,6 +1,7 @@
 #include "Arduino.h"
 #include "DigitalPin.h"
 #include "DigitalOut.h"
+#include "IrqGuard.h"
 
 // Simple digital output facade
 
@@ -8,6 +9,14 @@
 	// blank digitalout
 	DigitalOut::DigitalOut() : _Pin(NOPIN)
 	{
+#if defined(DIGITALOUT_FAST_SETCLR)
+		_SetReg = NULL;
+		_ClrReg = NULL;
+		_Mask = 0;
+#elif defined(DIGITALOUT_FAST_AVR)
+		_OutReg = NULL;
+		_Mask = 0;
+#endif
 	}
 
     // Create a DigitalOut connected to the specified pin
@@ -22,7 +31,22 @@
     {
 		_Pin = pin;
 		pinMode(pin, OUTPUT);
-		Write(value);
+		digitalWrite(pin, value ? HIGH : LOW);	// also lets the core turn off pwm
+		// look up the port once, Write is on the spi path
+#if defined(ARDUINO_ARCH_SAMD)
+		PortGroup* group = &PORT->Group[g_APinDescription[pin].ulPort];
+		_SetReg = &group->OUTSET.reg;
+		_ClrReg = &group->OUTCLR.reg;
+		_Mask = 1ul << g_APinDescription[pin].ulPin;
+#elif defined(DIGITALOUT_FAST_SETCLR)
+		NRF_GPIO_Type* port = digitalPinToPort(pin);
+		_SetReg = &port->OUTSET;
+		_ClrReg = &port->OUTCLR;
+		_Mask = digitalPinToBitMask(pin);
+#elif defined(DIGITALOUT_FAST_AVR)
+		_OutReg = portOutputRegister(digitalPinToPort(pin));
+		_Mask = digitalPinToBitMask(pin);
+#endif
     }
 
 	uint32_t DigitalOut::GetPin(void)
@@ -38,8 +62,22 @@
     // Set the output, specified as 0 or 1 (int)
     void DigitalOut::Write(int value)
     {
+#if defined(DIGITALOUT_FAST_SETCLR)
+		if(_SetReg != NULL)
+			*(value ? _SetReg : _ClrReg) = _Mask;
+#elif defined(DIGITALOUT_FAST_AVR)
+		if(_OutReg != NULL)
+		{
+			IrqGuard guard;		// an interrupt may write the same port
+			if(value)
+				*_OutReg |= _Mask;
+			else
+				*_OutReg &= ~_Mask;
+		}
+#else
 		if(_Pin != NOPIN)
 			digitalWrite(_Pin, value ? HIGH : LOW);
+#endif
     }
 
     // Return the output setting, represented as 0 or 1 (int)
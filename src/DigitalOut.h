@@ -1,7 +1,18 @@
 #ifndef DIGITALOUT_H
 #define DIGITALOUT_H
+#include <stdint.h>
 #include "DigitalPin.h"
 
+// Write goes straight to the port registers on cores where we know them (SAMD,
+// nRF52, AVR), else through digitalWrite. Define DIGITALOUT_NO_FAST to always use digitalWrite
+#if !defined(DIGITALOUT_NO_FAST)
+#if defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_NRF52)
+#define DIGITALOUT_FAST_SETCLR		// separate set and clear registers
+#elif defined(__AVR__)
+#define DIGITALOUT_FAST_AVR			// one output register, read-modify-write
+#endif
+#endif
+
 // Simple digital output facade
 class DigitalOut {
 
@@ -24,6 +35,14 @@ public:
 
 protected:
     uint8_t _Pin;
+#if defined(DIGITALOUT_FAST_SETCLR)
+	volatile uint32_t* _SetReg;		// NULL until SetPin
+	volatile uint32_t* _ClrReg;
+	uint32_t _Mask;
+#elif defined(DIGITALOUT_FAST_AVR)
+	volatile uint8_t* _OutReg;		// NULL until SetPin
+	uint8_t _Mask;
+#endif
 };
 
 #endif
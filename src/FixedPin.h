@@ -0,0 +1,72 @@
+#ifndef FIXEDPIN_H
+#define FIXEDPIN_H
+
+#include "Arduino.h"
+#include "DigitalOut.h"
+#include "IrqGuard.h"
+
+// DigitalOut and DigitalIn for pins fixed at compile time. There's no pin stored
+// and nothing to check, so the objects are empty and every call inlines. Call Begin
+// once before use.
+// |	FixedOut<8> cs;
+// |	cs.Begin(1);
+// |	cs = 0;
+// The cores keep their pin tables in variant code, so a write still reads the
+// port and bit from there (with a constant index) before the one store.
+
+template <uint8_t Pin>
+class FixedOut
+{
+	public:
+		static void Begin(int value)
+		{
+			pinMode(Pin, OUTPUT);
+			digitalWrite(Pin, value ? HIGH : LOW);
+		}
+
+		static void Write(int value)
+		{
+#if defined(ARDUINO_ARCH_SAMD)
+			PortGroup& group = PORT->Group[g_APinDescription[Pin].ulPort];
+			uint32_t mask = 1ul << g_APinDescription[Pin].ulPin;
+			if(value)
+				group.OUTSET.reg = mask;
+			else
+				group.OUTCLR.reg = mask;
+#elif defined(DIGITALOUT_FAST_SETCLR)
+			NRF_GPIO_Type* port = digitalPinToPort(Pin);
+			if(value)
+				port->OUTSET = digitalPinToBitMask(Pin);
+			else
+				port->OUTCLR = digitalPinToBitMask(Pin);
+#elif defined(DIGITALOUT_FAST_AVR)
+			volatile uint8_t* out = portOutputRegister(digitalPinToPort(Pin));
+			uint8_t mask = digitalPinToBitMask(Pin);
+			IrqGuard guard;
+			if(value)
+				*out |= mask;
+			else
+				*out &= ~mask;
+#else
+			digitalWrite(Pin, value ? HIGH : LOW);
+#endif
+		}
+
+		static int Read() { return (HIGH == digitalRead(Pin)) ? 1 : 0; }
+		static uint8_t GetPin() { return Pin; }
+		FixedOut& operator= (int value) { Write(value); return *this; }
+		FixedOut& operator= (bool value) { Write(value ? 1 : 0); return *this; }
+		operator int() { return Read(); }
+};
+
+template <uint8_t Pin>
+class FixedIn
+{
+	public:
+		static void Begin(uint8_t mode = INPUT) { pinMode(Pin, mode); }
+		static int Read() { return (HIGH == digitalRead(Pin)) ? 1 : 0; }
+		static uint8_t GetPin() { return Pin; }
+		operator int() { return Read(); }
+};
+
+#endif // FIXEDPIN_H
@@ -0,0 +1,273 @@
+// --------------------------------------------------------------------
+// HostLink frames binary records for the gateway -> host serial link
+// COBS (consistent overhead byte stuffing) removes every zero from the frame
+// so a single 0x00 marks the frame end and a reader resyncs after any glitch.
+// Deliberately free of Arduino headers so the host decoder builds the same file.
+// --------------------------------------------------------------------
+#include <string.h>
+#include "HostLink.h"
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff), bitwise to stay small in flash
+uint16_t HostLink::Crc16(const uint8_t* data, size_t len, uint16_t crc)
+{
+	while(len--)
+	{
+		crc ^= (uint16_t)(*data++) << 8;
+		for(int i = 0; i < 8; i++)
+		{
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+size_t HostLink::CobsEncode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize)
+{
+	if(outSize == 0)
+	{
+		return 0;
+	}
+	size_t codeAt = 0;		// where the current block's code byte goes
+	size_t at = 1;
+	uint8_t code = 1;
+	for(size_t i = 0; i < len; i++)
+	{
+		if(at >= outSize)
+		{
+			return 0;
+		}
+		if(data[i] != 0)
+		{
+			out[at++] = data[i];
+			code++;
+		}
+		if(data[i] == 0 || (code == 0xff && i + 1 < len))
+		{
+			// close this block, zeros are implied by the block end
+			out[codeAt] = code;
+			codeAt = at++;
+			code = 1;
+		}
+	}
+	if(codeAt >= outSize)
+	{
+		return 0;
+	}
+	out[codeAt] = code;
+	return at;
+}
+
+size_t HostLink::CobsDecode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize)
+{
+	size_t at = 0;
+	size_t i = 0;
+	while(i < len)
+	{
+		uint8_t code = data[i++];
+		if(code == 0 || i + code - 1 > len)
+		{
+			return 0;		// zeros can't appear inside a frame, or the block runs off the end
+		}
+		for(uint8_t j = 1; j < code; j++)
+		{
+			if(at >= outSize)
+			{
+				return 0;
+			}
+			out[at++] = data[i++];
+		}
+		if(code != 0xff && i < len)
+		{
+			if(at >= outSize)
+			{
+				return 0;
+			}
+			out[at++] = 0;
+		}
+	}
+	return at;
+}
+
+size_t HostLink::EncodeFrame(uint8_t frameType, const uint8_t* body, size_t len, uint8_t* out, size_t outSize)
+{
+	if(len > HOSTLINK_MAX_BODY)
+	{
+		return 0;
+	}
+	return EncodeInto(frameType, body, len, FrameCrc(frameType, body, len), out, (size_t)-1, 0, outSize);
+}
+
+uint16_t HostLink::FrameCrc(uint8_t frameType, const uint8_t* body, size_t len)
+{
+	return Crc16(body, len, Crc16(&frameType, 1));
+}
+
+size_t HostLink::EncodeFrameToRing(uint8_t frameType, const uint8_t* body, size_t len, uint16_t crc,
+	uint8_t* ring, size_t ringSize, size_t head, size_t room)
+{
+	if(len > HOSTLINK_MAX_BODY)
+	{
+		return 0;
+	}
+	return EncodeInto(frameType, body, len, crc, ring, ringSize - 1, head, room);
+}
+
+// COBS over [type][body][crc] as the bytes are produced, so the raw frame is never
+// built. Encoded byte i goes to out[(head + i) & mask], and each block's code byte
+// is filled in when the block ends
+size_t HostLink::EncodeInto(uint8_t frameType, const uint8_t* body, size_t len, uint16_t crc,
+	uint8_t* out, size_t mask, size_t head, size_t room)
+{
+	if(room < 2)
+	{
+		return 0;
+	}
+	size_t total = len + 3;
+	size_t codeAt = 0;		// where the current block's code byte goes
+	size_t at = 1;
+	uint8_t code = 1;
+	for(size_t i = 0; i < total; i++)
+	{
+		uint8_t value = (i == 0) ? frameType : (i <= len) ? body[i - 1] : (i == len + 1) ? (crc & 0xff) : (crc >> 8);
+		if(at >= room - 1)
+		{
+			return 0;		// always room for the delimiter
+		}
+		if(value != 0)
+		{
+			out[(head + at++) & mask] = value;
+			code++;
+		}
+		if(value == 0 || (code == 0xff && i + 1 < total))
+		{
+			out[(head + codeAt) & mask] = code;
+			codeAt = at++;
+			code = 1;
+		}
+	}
+	if(codeAt >= room - 1)
+	{
+		return 0;
+	}
+	out[(head + codeAt) & mask] = code;
+	out[(head + at) & mask] = 0;		// the delimiter
+	return at + 1;
+}
+
+static void PutU16(uint8_t* at, uint16_t value)
+{
+	at[0] = value & 0xff;
+	at[1] = value >> 8;
+}
+
+static uint16_t GetU16(const uint8_t* at)
+{
+	return (uint16_t)(at[0] | (at[1] << 8));
+}
+
+size_t HostLink::EncodePacket(const HostLinkPacket& pkt, uint8_t* out, size_t outSize)
+{
+	size_t len = HOSTLINK_PACKET_HEADER + pkt.payLength;
+	if(outSize < len)
+	{
+		return 0;
+	}
+	out[0] = HOSTLINK_PACKET_VERSION;
+	out[1] = pkt.radioId;
+	out[2] = pkt.dstAddress;
+	out[3] = pkt.srcAddress;
+	out[4] = pkt.srcLineCount;
+	out[5] = pkt.payLength;
+	PutU16(out + 6, (uint16_t)pkt.rssi);
+	PutU16(out + 8, (uint16_t)pkt.snrQuarter);
+	PutU16(out + 10, pkt.timeMs & 0xffff);
+	PutU16(out + 12, pkt.timeMs >> 16);
+	PutU16(out + 14, 0);		// reserved
+	PutU16(out + 16, (uint32_t)pkt.freqError & 0xffff);
+	PutU16(out + 18, (uint32_t)pkt.freqError >> 16);
+	if(pkt.payLength > 0)
+	{
+		memcpy(out + HOSTLINK_PACKET_HEADER, pkt.payload, pkt.payLength);
+	}
+	return len;
+}
+
+bool HostLink::DecodePacket(const uint8_t* body, size_t len, HostLinkPacket& pkt)
+{
+	if(len < HOSTLINK_PACKET_HEADER || body[0] != HOSTLINK_PACKET_VERSION)
+	{
+		return false;
+	}
+	pkt.radioId = body[1];
+	pkt.dstAddress = body[2];
+	pkt.srcAddress = body[3];
+	pkt.srcLineCount = body[4];
+	pkt.payLength = body[5];
+	pkt.rssi = (int16_t)GetU16(body + 6);
+	pkt.snrQuarter = (int16_t)GetU16(body + 8);
+	pkt.timeMs = GetU16(body + 10) | ((uint32_t)GetU16(body + 12) << 16);
+	pkt.freqError = (int32_t)(GetU16(body + 16) | ((uint32_t)GetU16(body + 18) << 16));
+	pkt.payload = body + HOSTLINK_PACKET_HEADER;
+	return len >= (size_t)(HOSTLINK_PACKET_HEADER + pkt.payLength);
+}
+
+// --------------------------------------------------------------------
+// HostLinkDecoder - the streaming reader
+// --------------------------------------------------------------------
+HostLinkDecoder::HostLinkDecoder(HostLinkFrameFn onFrame, void* context) :
+	_OnFrame(onFrame), _Context(context), _Length(0), _Overflow(false), _Good(0), _Bad(0)
+{
+}
+
+void HostLinkDecoder::SetHandler(HostLinkFrameFn onFrame, void* context)
+{
+	_OnFrame = onFrame;
+	_Context = context;
+}
+
+void HostLinkDecoder::Feed(const uint8_t* data, size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		Feed(data[i]);
+	}
+}
+
+void HostLinkDecoder::Feed(uint8_t value)
+{
+	if(value == 0)
+	{
+		EndFrame();
+		return;
+	}
+	if(_Length >= sizeof(_Buffer))
+	{
+		_Overflow = true;
+		return;
+	}
+	_Buffer[_Length++] = value;
+}
+
+// a delimiter arrived. decode in place, check the crc and hand it off
+void HostLinkDecoder::EndFrame()
+{
+	size_t encoded = _Length;
+	bool overflow = _Overflow;
+	_Length = 0;
+	_Overflow = false;
+	if(encoded == 0)
+	{
+		return;		// back to back delimiters are harmless
+	}
+	size_t len = overflow ? 0 : HostLink::CobsDecode(_Buffer, encoded, _Buffer, sizeof(_Buffer));
+	if(len < 3 || HostLink::Crc16(_Buffer, len - 2) != GetU16(_Buffer + len - 2))
+	{
+		_Bad++;
+		return;
+	}
+	_Good++;
+	if(_OnFrame)
+	{
+		(*_OnFrame)(_Context, _Buffer[0], _Buffer + 1, len - 3);
+	}
+}
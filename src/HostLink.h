@@ -0,0 +1,95 @@
+#ifndef HOST_LINK_H
+#define HOST_LINK_H
+
+// Binary framing for the serial link between a gateway and its host.
+// A frame is [type][body...][crc16 lo][crc16 hi], COBS encoded and ended by a 0x00
+// so the reader can always resynchronize at the next zero.
+// This file is plain C++ with no Arduino dependencies; the host side decoder
+// in extras/host compiles the same HostLink.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+
+// frame types
+#define HOSTLINK_TEXT 0x01			// a SerialWrap log line (body is the text, no terminator)
+#define HOSTLINK_PACKET 0x02		// a received LoRa packet (body is a HostLinkPacket record)
+#define HOSTLINK_SPITRACE 0x03		// whole SpiTrace records, concatenate the bodies
+
+// largest body we frame. A full LoRa payload plus the packet record fits
+#define HOSTLINK_MAX_BODY 300
+// worst case encoded size: type + body + crc, COBS overhead and the delimiter
+#define HOSTLINK_MAX_FRAME (HOSTLINK_MAX_BODY + 3 + (HOSTLINK_MAX_BODY + 3) / 254 + 2)
+
+#define HOSTLINK_PACKET_VERSION 2
+#define HOSTLINK_PACKET_HEADER 20		// bytes of record before the payload
+
+// the metadata that travels with each forwarded packet
+// on the wire it's little endian:
+//   version, radioId, dst, src, seq, payLength, rssi(i16 dBm), snr(i16 quarter dB), time(u32 ms), reserved(u16),
+//   freqError(i32 Hz)
+//   then payLength bytes of payload
+typedef struct
+{
+	uint8_t radioId;		// which radio on the gateway heard it
+	uint8_t dstAddress;
+	uint8_t srcAddress;
+	uint8_t srcLineCount;	// the sender's sequence byte
+	int16_t rssi;			// dBm
+	int16_t snrQuarter;		// snr in 0.25 dB steps
+	uint32_t timeMs;		// millis() at reception
+	int32_t freqError;		// Hz
+	uint8_t payLength;
+	const uint8_t* payload;	// points into the frame on decode
+} HostLinkPacket;
+
+class HostLink
+{
+	public:
+		static uint16_t Crc16(const uint8_t* data, size_t len, uint16_t crc = 0xffff);	// CRC-16/CCITT-FALSE
+		// COBS. Encode returns the encoded length (no delimiter) or 0 if out is too small
+		static size_t CobsEncode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize);
+		// decode returns the decoded length or 0 on a malformed frame. in-place is allowed
+		static size_t CobsDecode(const uint8_t* data, size_t len, uint8_t* out, size_t outSize);
+		// build a whole frame (encoded + 0x00 delimiter) into out. returns length or 0
+		static size_t EncodeFrame(uint8_t frameType, const uint8_t* body, size_t len, uint8_t* out, size_t outSize);
+		// the same frame written straight into a power of two ring from head (free running),
+		// so nothing is staged on the stack. crc is FrameCrc's. 0 if it needs more than room
+		static uint16_t FrameCrc(uint8_t frameType, const uint8_t* body, size_t len);
+		static size_t EncodeFrameToRing(uint8_t frameType, const uint8_t* body, size_t len, uint16_t crc,
+			uint8_t* ring, size_t ringSize, size_t head, size_t room);
+		// packet record body <-> struct. returns body length or 0 if too small/malformed
+		static size_t EncodePacket(const HostLinkPacket& pkt, uint8_t* out, size_t outSize);
+		static bool DecodePacket(const uint8_t* body, size_t len, HostLinkPacket& pkt);
+
+	private:
+		static size_t EncodeInto(uint8_t frameType, const uint8_t* body, size_t len, uint16_t crc,
+			uint8_t* out, size_t mask, size_t head, size_t room);
+};
+
+// incremental reader: feed it bytes as they arrive, it calls back with each good frame
+// bad CRC or malformed frames are counted and skipped
+typedef void (*HostLinkFrameFn)(void* context, uint8_t frameType, const uint8_t* body, size_t len);
+
+class HostLinkDecoder
+{
+	public:
+		HostLinkDecoder(HostLinkFrameFn onFrame = NULL, void* context = NULL);
+		void SetHandler(HostLinkFrameFn onFrame, void* context);
+		void Feed(const uint8_t* data, size_t len);
+		void Feed(uint8_t value);
+		uint32_t GoodFrames() const { return _Good; }
+		uint32_t BadFrames() const { return _Bad; }
+
+	private:
+		void EndFrame();
+
+		HostLinkFrameFn _OnFrame;
+		void* _Context;
+		uint8_t _Buffer[HOSTLINK_MAX_FRAME];
+		size_t _Length;
+		bool _Overflow;			// current frame is too long, discard through the next zero
+		uint32_t _Good;
+		uint32_t _Bad;
+};
+
+#endif // HOST_LINK_H
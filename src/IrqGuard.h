@@ -0,0 +1,73 @@
+#ifndef IRQ_GUARD_H
+#define IRQ_GUARD_H
+
+// A scoped interrupt lock that restores the previous state on exit, so it is
+// safe to use from both the loop and from inside an interrupt handler.
+// |	{
+// |		IrqGuard guard;		// interrupts masked until the end of the block
+// |		...
+// |	}
+// Keep the guarded block short, it delays every other interrupt on the cpu.
+
+class IrqGuard
+{
+	public:
+		IrqGuard()
+		{
+#if defined(__AVR__)
+			_State = SREG;
+			cli();
+#elif defined(__arm__)
+			_State = __get_PRIMASK();
+			__disable_irq();
+#elif defined(ARDUINO_ARCH_ESP32)
+			_State = portSET_INTERRUPT_MASK_FROM_ISR();
+#elif defined(ARDUINO_ARCH_ESP8266)
+			_State = xt_rsil(15);
+#elif defined(LIGHTLORA_HOST)
+			noInterrupts();		// host builds have no real interrupts to nest
+#else
+#error "IrqGuard can't save the interrupt state on this core"
+#endif
+		}
+
+		~IrqGuard()
+		{
+#if defined(__AVR__)
+			SREG = _State;
+#elif defined(__arm__)
+			if(!_State)
+			{
+				__enable_irq();
+			}
+#elif defined(ARDUINO_ARCH_ESP32)
+			portCLEAR_INTERRUPT_MASK_FROM_ISR(_State);
+#elif defined(ARDUINO_ARCH_ESP8266)
+			xt_wsr_ps(_State);
+#else
+			interrupts();
+#endif
+		}
+
+		// true if we are running inside an interrupt handler. avr and esp8266 can only
+		// tell that interrupts are masked, so loop code inside a guard (or cli()) counts too
+		static bool InInterrupt()
+		{
+#if defined(__AVR__)
+			return (SREG & 0x80) == 0;	// handlers run with the I bit clear
+#elif defined(__arm__)
+			return __get_IPSR() != 0;
+#elif defined(ARDUINO_ARCH_ESP32)
+			return xPortInIsrContext();
+#elif defined(ARDUINO_ARCH_ESP8266)
+			return (xt_rsr_ps() & 0x0f) != 0;	// the interrupt level
+#else
+			return false;
+#endif
+		}
+
+	private:
+		uint32_t _State;
+};
+
+#endif // IRQ_GUARD_H
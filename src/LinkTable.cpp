@@ -0,0 +1,162 @@
+// --------------------------------------------------------------------
+// LinkTable keeps per-peer link state for LoraUtil
+// A linear search of a handful of entries is faster than anything clever
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "LinkTable.h"
+
+void LinkPeer::AddSample(int8_t snrQuarter, int16_t rssi)
+{
+	snrHistory[historyNext] = snrQuarter;
+	rssiHistory[historyNext] = rssi;
+	historyNext = (historyNext + 1) % LINK_HISTORY;
+	if(historyCount < LINK_HISTORY)
+	{
+		historyCount++;
+	}
+}
+
+void LinkPeer::ClearHistory()
+{
+	historyNext = 0;
+	historyCount = 0;
+}
+
+int LinkPeer::AverageSnr()
+{
+	if(historyCount == 0)
+	{
+		return 0;
+	}
+	int sum = 0;
+	for(int i = 0; i < historyCount; i++)
+	{
+		sum += snrHistory[i];
+	}
+	return sum / historyCount;
+}
+
+int LinkPeer::AverageRssi()
+{
+	if(historyCount == 0)
+	{
+		return 0;
+	}
+	int32_t sum = 0;
+	for(int i = 0; i < historyCount; i++)
+	{
+		sum += rssiHistory[i];
+	}
+	return sum / historyCount;
+}
+
+// a new session means the peer restarted (or forgot us), so start a new window.
+// A sequence number far behind the window is taken the same way, not as a stale retry
+bool LinkPeer::Duplicate(uint8_t session, uint8_t seq)
+{
+	if(!rxSeqValid || session != rxSession)
+	{
+		rxSeqValid = true;
+		rxSession = session;
+		rxSeqHigh = seq;
+		rxSeqMask = 0;
+		return false;
+	}
+	int ahead = (int8_t)(seq - rxSeqHigh);
+	if(ahead == 0)
+	{
+		return true;
+	}
+	if(ahead > 0)
+	{
+		rxSeqMask = (ahead > 32) ? 0 : ((rxSeqMask << 1) | 1) << (ahead - 1);
+		rxSeqHigh = seq;
+		return false;
+	}
+	if(-ahead > 32)
+	{
+		rxSeqHigh = seq;
+		rxSeqMask = 0;
+		return false;
+	}
+	uint32_t bit = (uint32_t)1 << (-ahead - 1);
+	if(rxSeqMask & bit)
+	{
+		return true;
+	}
+	rxSeqMask |= bit;
+	return false;
+}
+
+LinkTable::LinkTable()
+{
+	Clear();
+}
+
+void LinkTable::Clear()
+{
+	memset(_Peers, 0, sizeof(_Peers));
+}
+
+LinkPeer* LinkTable::Find(uint8_t address)
+{
+	for(int i = 0; i < LINKTABLE_SIZE; i++)
+	{
+		if(_Peers[i].inUse && _Peers[i].address == address)
+		{
+			return &_Peers[i];
+		}
+	}
+	return NULL;
+}
+
+LinkPeer* LinkTable::FindOrAdd(uint8_t address)
+{
+	LinkPeer* peer = Find(address);
+	if(peer != NULL)
+	{
+		return peer;
+	}
+	// take a free slot, else the one we heard from longest ago
+	uint32_t now = millis();
+	LinkPeer* oldest = &_Peers[0];
+	for(int i = 0; i < LINKTABLE_SIZE; i++)
+	{
+		if(!_Peers[i].inUse)
+		{
+			oldest = &_Peers[i];
+			break;
+		}
+		if((now - _Peers[i].lastHeard) > (now - oldest->lastHeard))
+		{
+			oldest = &_Peers[i];
+		}
+	}
+	memset(oldest, 0, sizeof(LinkPeer));
+	oldest->address = address;
+	oldest->inUse = true;
+	oldest->lastHeard = now;
+	return oldest;
+}
+
+int LinkTable::Count()
+{
+	int count = 0;
+	for(int i = 0; i < LINKTABLE_SIZE; i++)
+	{
+		if(_Peers[i].inUse)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+LinkPeer* LinkTable::At(int index)
+{
+	if(index < 0 || index >= LINKTABLE_SIZE || !_Peers[index].inUse)
+	{
+		return NULL;
+	}
+	return &_Peers[index];
+}
@@ -0,0 +1,88 @@
+#ifndef LINK_TABLE_H
+#define LINK_TABLE_H
+
+// What we know about each peer we've heard from, keyed by LoraUtil address.
+// Fixed size: when it's full the peer heard from least recently is replaced.
+// Entries are updated from the receive interrupt, so keep access short.
+
+#ifndef LINKTABLE_SIZE
+#define LINKTABLE_SIZE 8
+#endif
+
+#define LINK_HISTORY 8				// snr/rssi samples kept per peer
+
+// adaptive data rate negotiation, see LoraUtil::Service
+enum AdrState
+{
+	ADR_IDLE = 0,
+	ADR_REQUESTED,		// we asked the peer to change, waiting for the accept
+	ADR_ACCEPTING,		// the peer asked, we owe it an accept
+	ADR_SWITCHING		// both sides agree, change once the radio is free
+};
+
+class LinkPeer
+{
+	public:
+		uint8_t address;
+		bool inUse;
+		uint32_t lastHeard;			// millis() of the last packet from this peer
+		// automatic frequency correction
+		int32_t freqError;			// filtered peer - base frequency, Hz
+		uint8_t feiCount;			// samples in the filter (saturates)
+		// link quality at the rate the peer uses now
+		int8_t snrHistory[LINK_HISTORY];	// 0.25 dB steps, a ring
+		int16_t rssiHistory[LINK_HISTORY];	// dBm
+		uint8_t historyNext;
+		uint8_t historyCount;
+		uint8_t unanswered;			// packets sent to it since we last heard from it
+		uint8_t unreplied;			// packets heard from it since we last sent to it
+		// adaptive data rate. zero means the radio's configured default
+		uint8_t spreadingFactor;
+		uint32_t bandwidth;
+		uint8_t adrState;			// AdrState
+		uint8_t adrSf;				// the rate being negotiated
+		uint32_t adrBw;
+		uint32_t adrTime;			// millis() of the last negotiation step
+		// transmit power control
+		int8_t heardSnr;			// last packet from it, 0.25 dB. Reported back to it
+		int16_t heardRssi;
+		uint8_t powerBackoff;		// dB below the configured power that we send to it with
+		int16_t reportMargin;		// filtered margin it hears us with, 0.25 dB
+		uint8_t reportCount;		// reports since the last power change
+		// reliable delivery: our own numbering of what we send it, apart from the header seq
+		bool txReliable;			// txSession is set
+		uint8_t txSession;
+		uint8_t txSeq;				// the last one used
+		// and the sequence numbers we've had from it, in its current session
+		bool rxSeqValid;
+		uint8_t rxSession;			// a new one means it restarted, so the window starts over
+		uint8_t rxSeqHigh;			// the newest
+		uint32_t rxSeqMask;			// bit n is rxSeqHigh - 1 - n
+		volatile bool ackOwed;		// Service sends an ack
+		// time sync: its last sync packet, for pairing with the time it sends next
+		bool syncValid;
+		uint8_t syncSeq;
+		uint32_t syncMicros;		// our micros() when it ended on air
+
+		void AddSample(int8_t snrQuarter, int16_t rssi);
+		void ClearHistory();
+		int AverageSnr();			// 0.25 dB steps
+		int AverageRssi();
+		bool Duplicate(uint8_t session, uint8_t seq);	// records seq in the receive window, true if it was already there
+};
+
+class LinkTable
+{
+	public:
+		LinkTable();
+		void Clear();
+		LinkPeer* Find(uint8_t address);		// NULL if we've never heard it
+		LinkPeer* FindOrAdd(uint8_t address);	// never NULL, may evict the stalest peer
+		int Count();							// peers in use
+		LinkPeer* At(int index);				// iterate, NULL if unused
+
+	private:
+		LinkPeer _Peers[LINKTABLE_SIZE];
+};
+
+#endif // LINK_TABLE_H
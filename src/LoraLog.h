@@ -0,0 +1,58 @@
+#ifndef LORA_LOG_H
+#define LORA_LOG_H
+
+// Compile-time log levels for the driver.
+// Every macro expands to ASeries.printf when its level is enabled. When it is not
+// the call sits behind if(0): the arguments are still type-checked (so no unused
+// variable warnings) but never evaluated, and the optimizer drops the call and the
+// format string entirely.
+// Define LORA_LOG_LEVEL before including (or as a build flag) to change it, e.g.
+//   -DLORA_LOG_LEVEL=LORA_LOG_LEVEL_NONE		for production builds
+//   -DLORA_LOG_LEVEL=LORA_LOG_LEVEL_TRACE		to see every register write
+
+#include "SerialWrap.h"
+
+#define LORA_LOG_LEVEL_NONE 0
+#define LORA_LOG_LEVEL_ERROR 1
+#define LORA_LOG_LEVEL_WARN 2
+#define LORA_LOG_LEVEL_INFO 3
+#define LORA_LOG_LEVEL_DEBUG 4
+#define LORA_LOG_LEVEL_TRACE 5
+
+#ifndef LORA_LOG_LEVEL
+#define LORA_LOG_LEVEL LORA_LOG_LEVEL_INFO
+#endif
+
+#define LORA_LOG_NOTHING(...) do { if(0) ASeries.printf(__VA_ARGS__); } while(0)
+
+#if LORA_LOG_LEVEL >= LORA_LOG_LEVEL_ERROR
+#define LORA_ERROR(...) ASeries.printf(__VA_ARGS__)
+#else
+#define LORA_ERROR(...) LORA_LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#if LORA_LOG_LEVEL >= LORA_LOG_LEVEL_WARN
+#define LORA_WARN(...) ASeries.printf(__VA_ARGS__)
+#else
+#define LORA_WARN(...) LORA_LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#if LORA_LOG_LEVEL >= LORA_LOG_LEVEL_INFO
+#define LORA_INFO(...) ASeries.printf(__VA_ARGS__)
+#else
+#define LORA_INFO(...) LORA_LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#if LORA_LOG_LEVEL >= LORA_LOG_LEVEL_DEBUG
+#define LORA_DEBUG(...) ASeries.printf(__VA_ARGS__)
+#else
+#define LORA_DEBUG(...) LORA_LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#if LORA_LOG_LEVEL >= LORA_LOG_LEVEL_TRACE
+#define LORA_TRACE(...) ASeries.printf(__VA_ARGS__)
+#else
+#define LORA_TRACE(...) LORA_LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#endif // LORA_LOG_H
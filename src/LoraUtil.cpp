@@ -14,7 +14,8 @@
 #include "TinyVector.h"
 #include "Sx127x.h"
 #include "SpiControl.h"
-#include "SerialWrap.h"
+#include "LoraLog.h"
+#include "HostLink.h"
 
 static SpiControl _MySpiControl;
 static Sx127x _MySx127x;
@@ -26,12 +27,21 @@ static Sx127x _MySx127x;
 	LoraPacket::LoraPacket()
 	{
 		msgTxt = "";
+		payload = NULL;
 		srcAddress = 0;
 		dstAddress = 0;
 		srcLineCount = 0;
 		payLength = 0;
 		rssi = 0;
 		snr = 0;
+		freqError = 0;
+		rxTime = 0;
+		rxMicros = 0;
+	}
+
+	LoraPacket::~LoraPacket()
+	{
+		delete[] payload;
 	}
 
 
@@ -76,13 +86,53 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 	//  a LoraUtil object has an sx1276 and it can send and receive LoRa packets
 	// 	sendPacket -> send a string
 	// 	isPacketAvailable -> do we have a packet available?
-	// 	readPacket -> get the latest packet
+	// 	readPacket -> get the oldest packet
 	void LoraUtil::Initialize(int pinSS, int pinRST, int pinINT, const StringPair* params)
 	{
 		// just be neat and init variables in the __init__
 		this->linecounter = 0;
-		this->packet = NULL;
+		this->rxHead = 0;
+		this->rxTail = 0;
+		this->rxDropped = 0;
+		this->batchLength = 0;
+		this->batchCount = 0;
+		this->batchDelay = 0;
+		this->sealedLength = 0;
+		this->sealedCount = 0;
+		this->telemetrySize = 0;
 		this->doneTransmit = false;
+		this->transmitting = false;
+		this->cadState = CAD_IDLE;
+		this->stagingEnabled = false;
+		this->stagedDst = 0;
+		this->rxWindowMs = 0;
+		this->rxWindowEnd = 0;
+		this->rxTimedOut = false;
+		this->rxAfterTx = false;
+		this->links.Clear();
+		this->reliable.Clear();
+		this->mesh.Clear();
+		this->meshEnabled = false;
+		this->meshHops = MESH_MAX_HOPS;
+		this->tdmaRole = TDMA_OFF;
+		this->tdmaFrameMax = 64;		// until a beacon says otherwise
+		this->tdmaSendMs = 0;
+		this->tdmaSynced = false;
+		this->tdmaBeaconHeard = false;
+		this->radioAsleep = false;
+		this->syncRole = TIMESYNC_OFF;
+		this->syncAwaitingTx = false;
+		this->deliveryCallback = NULL;
+		this->afcEnabled = false;
+		this->baseOffset = 0;
+		this->afcOffset = 0;
+		this->lastTempCheck = millis();
+		this->tpcEnabled = false;
+		this->tpcMargin = TPC_MARGIN_DB * 4;
+		this->tpcMinPower = 2;
+		this->adrEnabled = false;
+		this->adrMargin = ADR_MARGIN_DB * 4;
+		this->adrMaxBandwidth = 500000;
 
 		// init spi
 		this->spic = &_MySpiControl;	// static
@@ -93,19 +143,79 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 		this->lora->init(params);
 		this->dstAddress = 0x41;
 		this->localAddress = 0x41;
+		memset(this->addressMap, 0, sizeof(this->addressMap));
+		this->promiscuous = false;
+		AddAddress(this->localAddress);
+		AddAddress(0xff);
+		this->defaultSf = this->lora->getSpreadingFactor();
+		this->defaultBw = this->lora->getSignalBandwidth();
+		this->radioSf = this->defaultSf;
+		this->radioBw = this->defaultBw;
+		this->configuredPower = this->lora->getTxPower();
 
 		uint8_t utemp = this->lora->doCalibrate();
-		ASeries.printf("Read lora temperature: %d", utemp);
-		// pass in the callback capability
+		this->calTemperature = utemp;
+		LORA_INFO("Read lora temperature: %d", utemp);
+		// pass in the callback capability. The busy ones go direct
+		static const LoraCallbacks callbacks = { LoraUtil::OnReceive, LoraUtil::OnTransmit, LoraUtil::OnHeader };
 		this->lora->setReceiver(this);
+		this->lora->setCallbacks(&callbacks, this);
+		this->lora->setHeaderFilter(1);		// the destination address
 		// put into receive mode and wait for an interrupt
 		this->lora->receive();
+		this->bulk.SeedId(this->lora->randomBits(8) ^ micros());	// so a reboot doesn't reuse transfer ids
+		this->reliableSession = this->lora->randomBits(8) ^ micros();	// or reliable sessions
 	}
 
 	void LoraUtil::SetAddresses(uint8_t destAddress, uint8_t myAddress)
 	{
+		RemoveAddress(this->localAddress);
 		this->dstAddress = destAddress;
 		this->localAddress = myAddress;
+		AddAddress(myAddress);
+	}
+
+	// the receive filter is a bitmap of destinations, so any number of addresses costs the same
+	void LoraUtil::AddAddress(uint8_t address)
+	{
+		this->addressMap[address >> 3] |= 1 << (address & 7);
+	}
+
+	void LoraUtil::RemoveAddress(uint8_t address)
+	{
+		this->addressMap[address >> 3] &= ~(1 << (address & 7));
+	}
+
+	// everything is read and delivered, but control packets for others are ignored
+	void LoraUtil::SetPromiscuous(bool enable)
+	{
+		this->promiscuous = enable;
+	}
+
+	// a group is an address in the multicast range that we also receive. Anyone can
+	// send to it with SendPacket, members or not
+	bool LoraUtil::JoinGroup(uint8_t group)
+	{
+		if(!IsMulticast(group) || group == 0xff)
+		{
+			return false;
+		}
+		AddAddress(group);
+		return true;
+	}
+
+	void LoraUtil::LeaveGroup(uint8_t group)
+	{
+		if(IsMulticast(group) && group != 0xff)
+		{
+			RemoveAddress(group);
+		}
+	}
+
+	// interrupt time, before the payload is read. header[0] is the destination
+	bool LoraUtil::_acceptHeader(const uint8_t* header, int packetLength)
+	{
+		return this->promiscuous || Accepts(header[0]);
 	}
 
 	void LoraUtil::SetFrequency(double newFreq)
@@ -117,10 +227,533 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 
 	void LoraUtil::SetFrequencyOffset(int32_t offsetFreq)
 	{
-		double dox = offsetFreq;
+		this->baseOffset = offsetFreq;
+		double dox = offsetFreq + this->afcOffset;
 		this->lora->setFrequencyOffset(dox);
 	}
 
+	// with afc on we keep a filtered frequency error per peer (from the chip's fei)
+	// and retune to a peer's frequency before transmitting to it. The radio stays
+	// there to hear the reply. Turning it off returns to the static offset, or Service
+	// does once a frame on air is done
+	void LoraUtil::EnableAfc(bool enable)
+	{
+		this->afcEnabled = enable;
+		if(!enable && this->afcOffset != 0 && !this->transmitting)
+		{
+			ClearAfc();
+		}
+	}
+
+	void LoraUtil::ClearAfc()
+	{
+		this->lora->standby();
+		this->afcOffset = 0;
+		this->lora->setFrequencyOffset(this->baseOffset);
+		Listen();
+	}
+
+	int32_t LoraUtil::GetPeerFrequencyError(uint8_t address)
+	{
+		LinkPeer* peer = this->links.Find(address);
+		return (peer != NULL) ? peer->freqError : 0;
+	}
+
+	// with adr on we keep the snr of recent packets from each peer and move the
+	// link to the fastest spreading factor and bandwidth that still clears the
+	// demodulator floor by marginDb. Both ends must enable it: the change is
+	// agreed with a request/accept pair of control packets. Keep maxBandwidth
+	// to what your band plan allows. Not with tdma on, the slots are sized for the default rate
+	void LoraUtil::EnableAdr(bool enable, int marginDb, uint32_t maxBandwidth)
+	{
+		enable = enable && this->tdmaRole == TDMA_OFF;
+		this->adrEnabled = enable;
+		this->adrMargin = marginDb * 4;
+		this->adrMaxBandwidth = maxBandwidth;
+		if(!enable)
+		{
+			for(int i = 0; i < LINKTABLE_SIZE; i++)
+			{
+				LinkPeer* peer = this->links.At(i);
+				if(peer != NULL && (peer->spreadingFactor != 0 || peer->adrState != ADR_IDLE))
+				{
+					peer->spreadingFactor = 0;
+					peer->bandwidth = 0;
+					peer->adrState = ADR_IDLE;
+				}
+			}
+			if(!this->transmitting && (this->radioSf != this->defaultSf || this->radioBw != this->defaultBw))
+			{
+				this->lora->standby();
+				ApplyRate(0xff);
+				Listen();
+			}
+		}
+	}
+
+	// with tpc on each unicast packet tells the peer how we hear it, and we lower our
+	// power to a peer until the margin it reports is down to marginDb. Never above the
+	// configured tx_power_level. Both ends must enable it. Not with tdma on, every node
+	// must hear the beacon and slot 0 at full power
+	void LoraUtil::EnableTpc(bool enable, int marginDb, int minPower)
+	{
+		enable = enable && this->tdmaRole == TDMA_OFF;
+		this->tpcEnabled = enable;
+		this->tpcMargin = marginDb * 4;
+		this->tpcMinPower = minPower;
+		if(!enable)
+		{
+			for(int i = 0; i < LINKTABLE_SIZE; i++)
+			{
+				LinkPeer* peer = this->links.At(i);
+				if(peer != NULL)
+				{
+					peer->powerBackoff = 0;
+					peer->reportCount = 0;
+				}
+			}
+		}
+	}
+
+	int LoraUtil::GetPeerTxPower(uint8_t address)
+	{
+		return PeerPower(this->links.Find(address));
+	}
+
+	LinkTable& LoraUtil::Links()
+	{
+		return this->links;
+	}
+
+	// fei is measured against where we are tuned now, so add our correction back in
+	// to get the peer's offset from the base frequency. Interrupt time, integers only.
+	void LoraUtil::TrackFrequency(LinkPeer* peer, int32_t freqError)
+	{
+		int32_t sample = freqError + this->afcOffset;
+		if(peer->feiCount == 0)
+		{
+			peer->freqError = sample;
+		}
+		else
+		{
+			peer->freqError += (sample - peer->freqError) >> AFC_FILTER_SHIFT;
+		}
+		if(peer->feiCount < 255)
+		{
+			peer->feiCount++;
+		}
+	}
+
+	// must be in standby (beginPacket does that). Only touches Frf if it moved enough
+	void LoraUtil::ApplyAfc(uint8_t dstAddress)
+	{
+		LinkPeer* peer = this->links.Find(dstAddress);
+		if(peer == NULL || peer->feiCount < AFC_MIN_SAMPLES)
+		{
+			return;		// broadcast or unknown peer: stay where we are
+		}
+		int32_t want = peer->freqError;
+		if(abs(want - this->afcOffset) > AFC_HYSTERESIS_HZ)
+		{
+			this->afcOffset = want;
+			this->lora->setFrequencyOffset(this->baseOffset + want);
+		}
+	}
+
+	// the crystal drifts with temperature, and so does the image calibration
+	// recalibrate when the chip has moved AFC_RECAL_DEGREES since the last time.
+	// Reading it sleeps the radio, which loses a packet coming in and the fifo, so wait
+	// for a quiet moment. A staged packet gets one more interval to go out first
+	void LoraUtil::CheckTemperature()
+	{
+		uint32_t since = millis() - this->lastTempCheck;
+		if(this->transmitting || since < AFC_TEMP_CHECK_MS)
+		{
+			return;
+		}
+		if(this->lora->isSignalDetected() || (this->lora->hasStaged() && since < 2 * AFC_TEMP_CHECK_MS))
+		{
+			return;
+		}
+		this->lastTempCheck = millis();
+		uint8_t temp = this->lora->readTemperature();
+		int8_t moved = (int8_t)(temp - this->calTemperature);
+		if(abs(moved) >= AFC_RECAL_DEGREES)
+		{
+			LORA_INFO("Temperature moved %d, recalibrating", (int)moved);
+			this->calTemperature = this->lora->doCalibrate();
+		}
+	}
+
+	// demodulator snr floor for SF6..SF12 in 0.25 dB steps (datasheet table 13)
+	static const int8_t AdrSnrFloor[] = { -20, -30, -40, -50, -60, -70, -80 };
+	#define ADR_BANDWIDTHS 3
+	static const uint32_t AdrBandwidths[ADR_BANDWIDTHS] = { 125000, 250000, 500000 };
+
+	// log2(from/to) for bandwidths that are powers of two apart
+	static int HalvingSteps(uint32_t from, uint32_t to)
+	{
+		int steps = 0;
+		for( ; from >= to * 2; from /= 2)
+			steps++;
+		for( ; to >= from * 2; to /= 2)
+			steps--;
+		return steps;
+	}
+
+	uint8_t LoraUtil::PeerSf(const LinkPeer* peer)
+	{
+		return (peer != NULL && peer->spreadingFactor != 0) ? peer->spreadingFactor : this->defaultSf;
+	}
+
+	uint32_t LoraUtil::PeerBw(const LinkPeer* peer)
+	{
+		return (peer != NULL && peer->bandwidth != 0) ? peer->bandwidth : this->defaultBw;
+	}
+
+	// the fastest rate whose predicted snr clears the floor by the margin, else the most robust.
+	// The snr we measure doesn't depend on the spreading factor and rises 3 dB each time the
+	// bandwidth halves. Returns true if that's a change
+	bool LoraUtil::ChooseRate(LinkPeer* peer, uint8_t& sf, uint32_t& bw)
+	{
+		uint8_t nowSf = PeerSf(peer);
+		uint32_t nowBw = PeerBw(peer);
+		uint32_t nowRate = (nowBw >> nowSf) * nowSf;
+		int snr = peer->AverageSnr();
+		uint32_t bestRate = 0;
+		sf = 12;
+		bw = AdrBandwidths[0];
+		for(int i = 0; i < ADR_BANDWIDTHS && AdrBandwidths[i] <= this->adrMaxBandwidth; i++)
+		{
+			int predicted = snr + 12 * HalvingSteps(nowBw, AdrBandwidths[i]);
+			for(int s = 7; s <= 12; s++)		// sf6 needs implicit headers
+			{
+				uint32_t rate = (AdrBandwidths[i] >> s) * s;	// bits/s before coding
+				int need = this->adrMargin + ((rate > nowRate) ? ADR_STEP_UP_DB * 4 : 0);
+				if(rate > bestRate && predicted - AdrSnrFloor[s - 6] >= need)
+				{
+					bestRate = rate;
+					sf = s;
+					bw = AdrBandwidths[i];
+				}
+			}
+		}
+		return sf != nowSf || bw != nowBw;
+	}
+
+	// both ends call this when they agree. Starts a fresh history at the new rate
+	void LoraUtil::SwitchRate(LinkPeer* peer, uint8_t sf, uint32_t bw)
+	{
+		LORA_INFO("Link %d rate sf%d %d Hz", (int)peer->address, (int)(sf ? sf : this->defaultSf), (int)(bw ? bw : this->defaultBw));
+		peer->spreadingFactor = sf;
+		peer->bandwidth = bw;
+		peer->adrState = ADR_IDLE;
+		peer->adrTime = millis();
+		peer->unanswered = 0;
+		peer->unreplied = 0;
+		peer->ClearHistory();
+		peer->powerBackoff = 0;			// the new rate was picked for full power
+		peer->reportCount = 0;
+		this->lora->standby();
+		ApplyRate(peer->address);
+		this->rxAfterTx = false;
+		Listen();		// listen at the new rate
+	}
+
+	// must be in standby. Broadcasts and unknown peers use the default rate.
+	// The radio stays at the rate it last sent with, to hear the reply
+	void LoraUtil::ApplyRate(uint8_t dstAddress)
+	{
+		LinkPeer* peer = this->adrEnabled ? this->links.Find(dstAddress) : NULL;
+		uint8_t sf = PeerSf(peer);
+		uint32_t bw = PeerBw(peer);
+		if(sf != this->radioSf)
+		{
+			this->radioSf = sf;
+			this->lora->setSpreadingFactor(sf);
+		}
+		if(bw != this->radioBw)
+		{
+			this->radioBw = bw;
+			this->lora->setSignalBandwidth(bw);
+		}
+	}
+
+	static void PackRate(uint8_t* body, uint8_t sf, uint32_t bw)
+	{
+		body[0] = sf;
+		body[1] = (bw / 100) & 0xff;
+		body[2] = (bw / 100) >> 8;
+	}
+
+	int LoraUtil::PeerPower(const LinkPeer* peer)
+	{
+		return (peer != NULL) ? this->configuredPower - peer->powerBackoff : this->configuredPower;
+	}
+
+	// the peer told us how it heard our last packet. Move our power to it so the
+	// margin it sees stays near the target. Interrupt time, integers only
+	void LoraUtil::TrackReport(LinkPeer* peer, int8_t snrQuarter, uint8_t negRssi)
+	{
+		if(!this->tpcEnabled || snrQuarter == LORA_NO_REPORT)
+		{
+			return;
+		}
+		int floor = AdrSnrFloor[PeerSf(peer) - 6];
+		int margin = snrQuarter - floor;
+		if(snrQuarter >= TPC_SNR_SATURATED)
+		{
+			// strong signal: margin over the sensitivity (-174 dBm/Hz + 6 dB noise figure + floor)
+			int noise = -117 * 4 + 12 * HalvingSteps(PeerBw(peer), 125000);
+			margin = max(margin, -4 * (int)negRssi - noise - floor);
+		}
+		peer->reportMargin = (peer->reportCount == 0) ? margin : (peer->reportMargin + margin) / 2;
+		if(++peer->reportCount < TPC_MIN_REPORTS)
+		{
+			return;
+		}
+		int excess = (peer->reportMargin - this->tpcMargin) / 4;	// dB
+		if(abs(excess) < TPC_STEP_DB)
+		{
+			return;
+		}
+		int power = PeerPower(peer);
+		int want = min(max(power - excess, this->tpcMinPower), this->configuredPower);
+		if(want != power)
+		{
+			peer->powerBackoff = this->configuredPower - want;
+			peer->reportCount = 0;		// wait for reports at the new power
+		}
+	}
+
+	// must be in standby. Broadcasts and unknown peers get the configured power.
+	// Sx127x caches the pa registers so this is usually one write
+	void LoraUtil::ApplyPower(uint8_t dstAddress)
+	{
+		int power = PeerPower(this->links.Find(dstAddress));
+		if(power != this->lora->getTxPower())
+		{
+			this->lora->setTxPower(power, this->lora->getPaOutputPin());
+		}
+	}
+
+	// a peer that stops answering may not hear us any more
+	void LoraUtil::ServiceTpc()
+	{
+		for(int i = 0; i < LINKTABLE_SIZE; i++)
+		{
+			LinkPeer* peer = this->links.At(i);
+			if(peer != NULL && peer->powerBackoff != 0 && peer->unanswered >= TPC_MAX_UNANSWERED)
+			{
+				LORA_WARN("No answer from %d, back to full power", (int)peer->address);
+				peer->powerBackoff = 0;
+				peer->reportCount = 0;
+			}
+		}
+	}
+
+	// one control packet per call at most, only when the radio is free
+	void LoraUtil::ServiceAdr()
+	{
+		uint32_t now = millis();
+		uint8_t body[3];
+		for(int i = 0; i < LINKTABLE_SIZE; i++)
+		{
+			LinkPeer* peer = this->links.At(i);
+			if(peer == NULL)
+			{
+				continue;
+			}
+			switch(peer->adrState)
+			{
+				case ADR_ACCEPTING:
+					if(!this->transmitting)
+					{
+						PackRate(body, peer->adrSf, peer->adrBw);
+						SendControl(peer->address, LORA_CTRL_ADR_ACCEPT, body, sizeof(body), NextSeq());
+						peer->adrState = ADR_SWITCHING;		// after the accept is out
+					}
+					break;
+				case ADR_SWITCHING:
+					if(!this->transmitting)
+					{
+						SwitchRate(peer, peer->adrSf, peer->adrBw);
+					}
+					break;
+				case ADR_REQUESTED:
+					if((now - peer->adrTime) > ADR_REPLY_MS)
+					{
+						LORA_DEBUG("No adr accept from %d", (int)peer->address);
+						peer->adrState = ADR_IDLE;
+						peer->adrTime = now;
+					}
+					break;
+				default:
+					// it can't hear us at this rate (or we changed and it didn't). The other end counts
+					// the same packets the other way: if it has sent that many with no reply it has gone
+					// back, so we do too. A peer that's gone quiet may have, after losses, so time out as well
+					if(peer->spreadingFactor != 0 && (peer->unanswered >= ADR_MAX_UNANSWERED ||
+							peer->unreplied >= ADR_MAX_UNANSWERED || (now - peer->lastHeard) > ADR_SILENT_MS))
+					{
+						// SwitchRate goes to standby, so wait for anything on air
+						if(this->transmitting)
+						{
+							break;
+						}
+						LORA_WARN("Lost %d, back to the default rate", (int)peer->address);
+						SwitchRate(peer, 0, 0);
+					}
+					else if(!this->transmitting && peer->historyCount >= ADR_MIN_SAMPLES &&
+							(now - peer->adrTime) > ADR_REPLY_MS &&
+							ChooseRate(peer, peer->adrSf, peer->adrBw))
+					{
+						PackRate(body, peer->adrSf, peer->adrBw);
+						SendControl(peer->address, LORA_CTRL_ADR_REQUEST, body, sizeof(body), NextSeq());
+						peer->adrState = ADR_REQUESTED;
+						peer->adrTime = now;
+					}
+					break;
+			}
+		}
+	}
+
+	// acks owed, acks received, and retries. One packet per call at most
+	void LoraUtil::ServiceReliable()
+	{
+		for(int i = 0; i < LINKTABLE_SIZE && !this->transmitting; i++)
+		{
+			LinkPeer* peer = this->links.At(i);
+			if(peer != NULL && peer->ackOwed)
+			{
+				// our receive window, so one ack covers everything we've had lately
+				peer->ackOwed = false;
+				uint8_t body[6];
+				body[0] = peer->rxSession;
+				body[1] = peer->rxSeqHigh;
+				for(int j = 0; j < 4; j++)
+				{
+					body[2 + j] = (peer->rxSeqMask >> (8 * j)) & 0xff;
+				}
+				SendControl(peer->address, LORA_CTRL_ACK, body, sizeof(body), NextSeq());
+			}
+		}
+		uint32_t now = millis();
+		for(int i = 0; i < RELIABLE_SLOTS; i++)
+		{
+			ReliableSlot* slot = this->reliable.At(i);
+			if(slot == NULL)
+			{
+				continue;
+			}
+			bool delivered = (slot->state == RELIABLE_ACKED);
+			if(!delivered && (this->transmitting || (now - slot->sentAt) < slot->timeout))
+			{
+				continue;
+			}
+			if(!delivered && slot->tries < RELIABLE_MAX_TRIES)
+			{
+				if(FitsSlot(slot->data.Size() + 5))
+				{
+					SendTry(slot);
+				}
+				continue;
+			}
+			if(!delivered)
+			{
+				LORA_DEBUG("No ack from %d for %d", (int)slot->dstAddress, (int)slot->seq);
+			}
+			uint8_t dst = slot->dstAddress;
+			uint8_t seq = slot->seq;
+			this->reliable.Free(slot);
+			if(this->deliveryCallback != NULL)
+			{
+				this->deliveryCallback(dst, seq, delivered);
+			}
+		}
+	}
+
+	// fragments go out back to back, one per call, as fast as the loop calls Service
+	void LoraUtil::ServiceBulk()
+	{
+		this->bulk.Service(millis());
+		if(this->transmitting)
+		{
+			return;
+		}
+		uint8_t frame[BULK_FRAME_MAX];
+		uint8_t dst = 0;
+		int length = this->bulk.NextFrame(millis(), dst, frame);
+		if(length > 0)
+		{
+			SendControl(dst, frame[0], frame + 1, length - 1, NextSeq());
+			// time for this frame, the ack and the peer's turnaround, in case it polled
+			uint32_t air = this->lora->timeOnAir(length + 4) + this->lora->timeOnAir(12);
+			this->bulk.FrameSent(millis(), air / 1000 + RELIABLE_TURNAROUND_MS);
+		}
+	}
+
+	// the loop calls this to do anything that can't happen in an interrupt
+	void LoraUtil::Service()
+	{
+		if(this->afcEnabled)
+		{
+			CheckTemperature();
+		}
+		else if(this->afcOffset != 0 && !this->transmitting)
+		{
+			ClearAfc();		// EnableAfc(false) during a send
+		}
+		if(this->tpcEnabled)
+		{
+			ServiceTpc();
+		}
+		bool canSend = true;
+		if(this->tdmaRole != TDMA_OFF)
+		{
+			canSend = ServiceTdma();		// only in our slot
+		}
+		if(canSend && !this->transmitting)
+		{
+			// a sealed batch is older than the held one, so the held one waits for it
+			if(this->sealedLength == 0 && this->batchLength > 0 && (this->tdmaRole != TDMA_OFF || (millis() - this->batchStart) >= this->batchDelay))
+			{
+				CloseBatch();
+			}
+			if(this->sealedLength > 0 && !this->transmitting && FitsSlot(5 + this->sealedLength + LORA_TRAILER_SIZE))
+			{
+				SendBatch();
+			}
+		}
+		if(canSend)
+		{
+			ServiceMesh();
+			if(this->syncRole != TIMESYNC_OFF)
+			{
+				ServiceTimeSync();
+			}
+			ServiceReliable();
+			ServiceBulk();
+			if(this->adrEnabled)
+			{
+				ServiceAdr();
+			}
+		}
+		if(this->rxWindowMs > 0 && this->lora->isWindowOpen() && (int32_t)(millis() - this->rxWindowEnd) >= 0)
+		{
+			// without DIO1 there's no timeout interrupt
+			this->lora->closeWindow();
+			this->rxTimedOut = true;
+		}
+		if(this->rxAfterTx && !this->transmitting)
+		{
+			this->rxAfterTx = false;
+			if(this->rxWindowMs == 0)		// else tx done opened a window
+			{
+				Listen();
+			}
+		}
+	}
+
 	String LoraUtil::GetError(bool doClear)
 	{
 		// don't return the address, copy it so interrupts don't trash us
@@ -145,46 +778,237 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 	// we received a packet, deal with it
 	void LoraUtil::_doReceive(TinyVector* pay)
 	{
-		// check that it's for us...
-		if (pay!=NULL && pay->Size() > 1)
+		if(pay != NULL)
+		{
+			ReceiveFrame(pay->Data(), pay->Size());
+		}
+	}
+
+	// interrupt time
+	void LoraUtil::ReceiveFrame(uint8_t* repay, int size)
+	{
+		if(this->telemetrySize > 0)
+		{
+			// [src][seq][payload]. There's no destination, everyone listening gets it
+			if(size >= LORA_TELEMETRY_HEADER + this->telemetrySize)
+			{
+				uint32_t rxTime = this->lora->getLastReceivedTime();
+				HeardFrom(repay[0], 0, rxTime);
+				uint8_t header[3] = { 0xff, repay[0], repay[1] };
+				DeliverPacket(header, repay + LORA_TELEMETRY_HEADER, this->telemetrySize, rxTime);
+			}
+			return;
+		}
+		// the address filter (_acceptHeader) already ran
+		if (size > 4)
 		{
-			uint8_t* repay = pay->Data();
-			uint8_t dstaddr = repay[0];
-			// allow an address of zero for all
-			if(dstAddress != 0xff && dstAddress != this->localAddress)
+			uint32_t rxTime = this->lora->getLastReceivedTime();
+			if(!Accepts(repay[0]))
+			{
+				// promiscuous. The sender's report is about another link, so just deliver data
+				if(repay[3] != LORA_CONTROL)
+				{
+					DeliverPacket(repay, repay + 4, min((int)repay[3], size - 4), rxTime);
+				}
+				return;
+			}
+			int backoff = 0;
+			uint8_t* trailer = NULL;
+			if(repay[3] != LORA_CONTROL && size - 4 - repay[3] >= LORA_TRAILER_SIZE)
 			{
-				ASeries.printf("Received packet for %d, I am %d", (int)dstaddr, (int)this->localAddress);
-				return;		// ignore this result, it's not for us
+				trailer = repay + 4 + repay[3];
+				backoff = trailer[0];
 			}
+			LinkPeer* peer = HeardFrom(repay[1], backoff, rxTime);
+			if(trailer != NULL)
+			{
+				TrackReport(peer, (int8_t)trailer[1], trailer[2]);
+			}
+			if(repay[3] == LORA_CONTROL)
+			{
+				HandleControl(peer, repay, size);
+				return;
+			}
+			DeliverPacket(repay, repay + 4, min((int)repay[3], size - 4), rxTime);
 		}
-		if(this->packet)
+	}
+
+	// update what we know about the sender of the packet just received.
+	// backoff is how far below full power it says it sent
+	LinkPeer* LoraUtil::HeardFrom(uint8_t address, int backoff, uint32_t rxTime)
+	{
+		const LoraPacketInfo& info = this->lora->lastPacketInfo();	// captured with the payload, no more spi
+		LinkPeer* peer = this->links.FindOrAdd(address);
+		peer->lastHeard = rxTime;
+		peer->unanswered = 0;
+		if(peer->unreplied < 255)
 		{
-			delete this->packet;
-			this->packet = NULL;
+			peer->unreplied++;
 		}
-		if (pay!=NULL && pay->Size() > 4)
+		peer->heardSnr = info.snrQuarter;
+		peer->heardRssi = info.rssi;
+		// history is kept as if the peer sent at full power, so tpc doesn't drive adr
+		peer->AddSample(min(info.snrQuarter + 4 * backoff, 127), info.rssi + backoff);
+		if(this->afcEnabled)
 		{
-			LoraPacket* pkt = new LoraPacket();
-			uint8_t* repay = pay->Data();
-			pkt->dstAddress = repay[0];
-			pkt->srcAddress = repay[1];
-			pkt->srcLineCount = repay[2];
-			pkt->payLength = repay[3];
-			pkt->snr = this->lora->packetSnr();			// real snr, calced from the packetSnr value
-			pkt->rssi = this->lora->packetRssi();		// this is real rssi, calced from the sx127x packetRssi value
-			if(pkt->payLength > 0)
-				pkt->msgTxt = (const char*)(repay+4);	// payloads are null terminated during reception
-			else
-				pkt->msgTxt = "";
-			this->packet = pkt;
+			TrackFrequency(peer, info.freqError);
+		}
+		return peer;
+	}
+
+	// queue a LoraPacket for ReadPacket. The payload is in the receive buffer, which
+	// always has a byte after it, so we can null terminate it in place for msgTxt.
+	// When the queue is full the new packet is dropped (ReadPacket owns the tail)
+	void LoraUtil::DeliverPacket(const uint8_t* header, uint8_t* payload, uint8_t length, uint32_t rxTime)
+	{
+		uint8_t next = (this->rxHead + 1) % LORA_RX_QUEUE;
+		if(next == this->rxTail)
+		{
+			this->rxDropped++;
+			return;
+		}
+		const LoraPacketInfo& info = this->lora->lastPacketInfo();
+		LoraPacket* pkt = new LoraPacket();
+		pkt->dstAddress = header[0];
+		pkt->srcAddress = header[1];
+		pkt->srcLineCount = header[2];
+		pkt->payLength = length;
+		pkt->snr = info.snrQuarter * 0.25f;		// real snr, calced from the packetSnr value
+		pkt->rssi = info.rssi;					// this is real rssi, calced from the sx127x packetRssi value
+		pkt->freqError = info.freqError;
+		pkt->rxTime = rxTime;
+		pkt->rxMicros = info.endMicros;
+		if(pkt->payLength > 0)
+		{
+			pkt->payload = new uint8_t[length];
+			memcpy(pkt->payload, payload, length);
+			uint8_t save = payload[length];
+			payload[length] = 0;
+			pkt->msgTxt = (const char*)payload;
+			payload[length] = save;
+		}
+		else
+			pkt->msgTxt = "";
+		this->rxQueue[this->rxHead] = pkt;
+		this->rxHead = next;
+	}
+
+	// a control packet arrived. Just record what to do, Service sends any reply
+	void LoraUtil::HandleControl(LinkPeer* peer, uint8_t* frame, int size)
+	{
+		uint8_t* body = frame + 4;
+		int length = size - 4;
+		if(length < 1)
+		{
+			return;
+		}
+		switch(body[0])
+		{
+			case LORA_CTRL_RELIABLE:
+				if(length < 3)
+				{
+					return;
+				}
+				// always ack, our last ack may have been lost
+				peer->ackOwed = true;
+				if(peer->Duplicate(body[1], body[2]))
+				{
+					LORA_TRACE("Duplicate %d from %d", (int)body[2], (int)peer->address);
+				}
+				else
+				{
+					DeliverPacket(frame, body + 3, length - 3, peer->lastHeard);
+				}
+				break;
+			case LORA_CTRL_BATCH:
+				// [length][record]... each one becomes its own packet
+				for(int i = 1; i < length && i + 1 + body[i] <= length; i += 1 + body[i])
+				{
+					DeliverPacket(frame, body + i + 1, body[i], peer->lastHeard);
+				}
+				break;
+			case LORA_CTRL_BEACON:
+				if(this->tdmaRole == TDMA_NODE && length >= 5 && body[1] > 0)
+				{
+					this->tdmaSlots = body[1];
+					this->tdmaSlotMs = body[2] | (body[3] << 8);
+					this->tdmaFrameMax = body[4];
+					this->tdmaBeaconAt = peer->lastHeard;
+					this->tdmaBeaconHeard = true;
+				}
+				break;
+			case LORA_CTRL_SYNC:
+				if(this->syncRole == TIMESYNC_NODE && length >= 8)
+				{
+					ReceiveSync(peer, body + 1);
+				}
+				break;
+			case LORA_CTRL_MESH:
+				ReceiveMesh(peer, body + 1, length - 1);
+				break;
+			case LORA_CTRL_BULK_START:
+			case LORA_CTRL_BULK_DATA:
+			case LORA_CTRL_BULK_ACK:
+			case LORA_CTRL_BULK_CANCEL:
+				this->bulk.OnControl(peer->address, body, length);
+				break;
+			case LORA_CTRL_ACK:
+				if(length >= 7)
+				{
+					uint32_t mask = body[3] | ((uint32_t)body[4] << 8) | ((uint32_t)body[5] << 16) | ((uint32_t)body[6] << 24);
+					this->reliable.Acknowledge(peer->address, body[1], body[2], mask);
+				}
+				break;
+			case LORA_CTRL_ADR_REQUEST:
+			case LORA_CTRL_ADR_ACCEPT:
+			{
+				if(!this->adrEnabled || length < 4)
+				{
+					return;		// no accept, so the requester times out
+				}
+				uint8_t sf = body[1];
+				uint32_t bw = (uint32_t)(body[2] | (body[3] << 8)) * 100;
+				if(sf < 7 || sf > 12 || bw > this->adrMaxBandwidth)
+				{
+					return;
+				}
+				if(body[0] == LORA_CTRL_ADR_ACCEPT)
+				{
+					if(peer->adrState == ADR_REQUESTED && sf == peer->adrSf && bw == peer->adrBw)
+					{
+						peer->adrState = ADR_SWITCHING;
+					}
+				}
+				else if(peer->adrState != ADR_REQUESTED || this->localAddress > peer->address)
+				{
+					// on a crossed request the lower address wins
+					peer->adrSf = sf;
+					peer->adrBw = bw;
+					peer->adrState = ADR_ACCEPTING;
+				}
+				break;
+			}
+			default:
+				LORA_TRACE("Unknown control %d from %d", (int)body[0], (int)peer->address);
+				break;
 		}
 	}
 
 	// the transmit ended
 	void LoraUtil::_doTransmit()
 	{
+		if(this->syncAwaitingTx)
+		{
+			this->syncSentMicros = this->lora->getLastSentMicros();
+			this->syncSentValid = true;
+			this->syncAwaitingTx = false;
+		}
 		this->doneTransmit = true;
-		// this->lora->receive(); // wait for a packet (?)
+		this->transmitting = false;
+		if(this->rxWindowMs > 0)
+		{
+			Listen();		// the answer comes right after, so open the window now
+		}
 	}
 
 	bool LoraUtil::IsPacketSent(bool forceClear)
@@ -205,51 +1029,832 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 
 	void LoraUtil::WaitForPacket()
 	{
-		this->lora->receive();
+		Listen();
 	}
 
-	void LoraUtil::SendPacket(uint8_t dstAddress, uint8_t localAddress, TinyVector& outGoing)
+	// for request/response. The radio sleeps except for a short window after each
+	// send, and WaitForPacket opens one window too. Not for tdma, which listens on its own schedule
+	void LoraUtil::EnableRxWindow(uint16_t windowMs)
 	{
-		// send a packet of header info and a bytearray to dstAddress
-		this->linecounter = this->linecounter + 1;
-		this->lora->beginPacket();
-		this->doneTransmit = false;				// do this after beginpacket because it clears the irq
-		this->writeInt(dstAddress);				// four byte header
-		this->writeInt(localAddress);
-		this->writeInt(this->linecounter);
-		this->writeInt(outGoing.Size());
-		this->lora->writeFifo(outGoing.Data(), outGoing.Size());	// data
-		this->lora->endPacket();
+		this->rxWindowMs = windowMs;
+		this->rxTimedOut = false;
 	}
 
-	// send a string. use hardcoded src, dst address
-	void LoraUtil::SendString(const String& Content)
+	bool LoraUtil::IsRxTimeout(bool forceClear)
+	{
+		bool timedOut = this->rxTimedOut;
+		if(forceClear)
+		{
+			this->rxTimedOut = false;
+		}
+		return timedOut;
+	}
+
+	// interrupt time. The radio is already asleep
+	void LoraUtil::_doRxTimeout()
+	{
+		this->rxTimedOut = true;
+	}
+
+	void LoraUtil::SetDioPins(int dio1Pin, int dio3Pin)
+	{
+		this->lora->setDioPins(dio1Pin, dio3Pin);
+	}
+
+	// a cad takes a couple of symbols, then CadResult says what it found. Call
+	// WaitForPacket or send afterwards, the radio doesn't go back to receive by itself
+	bool LoraUtil::StartCad()
+	{
+		if(this->transmitting)
+		{
+			return false;
+		}
+		this->cadState = CAD_RUNNING;
+		this->radioAsleep = false;
+		this->lora->startCad();
+		return true;
+	}
+
+	uint8_t LoraUtil::CadResult()
+	{
+		return this->cadState;
+	}
+
+	// interrupt time
+	void LoraUtil::_doCadDone(bool detected)
+	{
+		this->cadState = detected ? CAD_BUSY : CAD_CLEAR;
+	}
+
+	// implicit header frames have no length, so the chip is told what to expect
+	void LoraUtil::Listen()
+	{
+		this->radioAsleep = false;
+		int size = this->telemetrySize > 0 ? LORA_TELEMETRY_HEADER + this->telemetrySize : 0;
+		if(this->rxWindowMs > 0)
+		{
+			// a packet that starts at the end of the window can still run its full length
+			this->rxWindowEnd = millis() + this->rxWindowMs + this->lora->timeOnAir(255) / 1000 + 1;
+			this->lora->receiveWindow(this->rxWindowMs * 1000UL, size);
+		}
+		else
+		{
+			this->lora->receive(size);
+		}
+	}
+
+	void LoraUtil::SendPacket(uint8_t dstAddress, uint8_t localAddress, TinyVector& outGoing)
+	{
+		// send a packet of header info and a bytearray to dstAddress
+		BeginFrame(dstAddress, localAddress, NextSeq(), outGoing.Size());
+		this->lora->writeFifo(outGoing.Data(), outGoing.Size());	// data
+		EndFrame(dstAddress, outGoing.Size(), true);
+	}
+
+	uint8_t LoraUtil::NextSeq()
+	{
+		this->linecounter = this->linecounter + 1;
+		return this->linecounter;
+	}
+
+	// standby, tune for the destination and write the four byte header. Then the caller fills the fifo
+	void LoraUtil::BeginFrame(uint8_t dstAddress, uint8_t localAddress, uint8_t seq, uint8_t lengthByte)
+	{
+		this->lora->beginPacket();
+		this->radioAsleep = false;
+		this->doneTransmit = false;				// do this after beginpacket because it clears the irq
+		this->transmitting = true;
+		TuneFor(dstAddress);
+		this->writeInt(dstAddress);				// four byte header
+		this->writeInt(localAddress);
+		this->writeInt(seq);
+		this->writeInt(lengthByte);
+	}
+
+	// must be in standby
+	void LoraUtil::TuneFor(uint8_t dstAddress)
+	{
+		if(this->afcEnabled)
+		{
+			ApplyAfc(dstAddress);				// we're in standby so this is just the Frf registers
+		}
+		if(this->adrEnabled)
+		{
+			ApplyRate(dstAddress);
+		}
+		if(this->tpcEnabled)
+		{
+			ApplyPower(dstAddress);
+		}
+		LinkPeer* peer = this->links.Find(dstAddress);
+		if(peer != NULL && peer->unanswered < 255)
+		{
+			peer->unanswered++;
+		}
+		if(peer != NULL)
+		{
+			peer->unreplied = 0;
+		}
+	}
+
+	// add the link report if this packet can carry one, and send
+	void LoraUtil::EndFrame(uint8_t dstAddress, int size, bool canReport)
+	{
+		WriteTrailer(dstAddress, size, canReport);
+		this->lora->endPacket();
+	}
+
+	void LoraUtil::WriteTrailer(uint8_t dstAddress, int size, bool canReport)
+	{
+		if(canReport && this->tpcEnabled && !IsMulticast(dstAddress) && size + 4 + LORA_TRAILER_SIZE <= 255)
+		{
+			LinkPeer* peer = this->links.Find(dstAddress);
+			uint8_t trailer[LORA_TRAILER_SIZE];
+			trailer[0] = this->configuredPower - PeerPower(peer);
+			trailer[1] = (peer != NULL) ? peer->heardSnr : LORA_NO_REPORT;
+			trailer[2] = (peer != NULL) ? min(max(-peer->heardRssi, 0), 255) : 0;
+			this->lora->writeFifo(trailer, sizeof(trailer));
+		}
+	}
+
+	// for a polling gateway. The fifo is split so the next request can be loaded while
+	// waiting for the current answer, and sending it is then a few register writes.
+	// Staged packets are limited to half the fifo, other sends still get all of it
+	void LoraUtil::EnableStaging(bool enable)
+	{
+		this->stagingEnabled = enable;
+		this->lora->enableStaging(enable);
+		Listen();
+	}
+
+	// built like SendPacket, sequence number and link report included. The radio spends a
+	// moment in standby to fill the fifo and then goes back to receive
+	bool LoraUtil::StagePacket(uint8_t dstAddress, TinyVector& outGoing)
+	{
+		if(!this->stagingEnabled || this->transmitting || this->telemetrySize > 0 || outGoing.Size() > LORA_STAGE_MAX)
+		{
+			return false;
+		}
+		this->lora->beginStage();
+		this->stagedDst = dstAddress;
+		this->writeInt(dstAddress);
+		this->writeInt(this->localAddress);
+		this->writeInt(NextSeq());
+		this->writeInt(outGoing.Size());
+		this->lora->writeFifo(outGoing.Data(), outGoing.Size());
+		WriteTrailer(dstAddress, outGoing.Size(), true);
+		this->lora->endStage();
+		Listen();
+		return true;
+	}
+
+	bool LoraUtil::SendStaged()
+	{
+		if(this->transmitting || !this->lora->hasStaged())
+		{
+			return false;
+		}
+		this->lora->standby();
+		this->radioAsleep = false;
+		this->doneTransmit = false;
+		this->transmitting = true;
+		TuneFor(this->stagedDst);			// rate, power or afc may have moved since
+		if(!this->lora->sendStaged())
+		{
+			this->transmitting = false;		// a packet came in over it just now
+			Listen();
+			return false;
+		}
+		return true;
+	}
+
+	// control packets come from Service, so the radio goes back to receive when it's sent
+	void LoraUtil::SendControl(uint8_t dstAddress, uint8_t opcode, const uint8_t* body, int length, uint8_t seq)
+	{
+		BeginFrame(dstAddress, this->localAddress, seq, LORA_CONTROL);
+		this->writeInt(opcode);
+		this->lora->writeFifo(body, length);
+		EndFrame(dstAddress, length + 1, false);		// no length field, so no room for a report
+		this->rxAfterTx = true;
+	}
+
+	// queue a packet that's resent until dstAddress acks it. Returns its sequence
+	// number (for the delivery callback) or -1 if RELIABLE_SLOTS are in flight.
+	// The ack window counts only reliable packets to this peer, within a session
+	// that's new each boot, so other traffic and restarts can't fake a duplicate
+	int LoraUtil::SendReliable(uint8_t dstAddress, TinyVector& outGoing)
+	{
+		if(IsMulticast(dstAddress) || outGoing.Size() > LORA_RELIABLE_MAX)
+		{
+			return -1;		// no acks for broadcasts or groups
+		}
+		if(this->tdmaRole != TDMA_OFF && outGoing.Size() + 7 > this->tdmaFrameMax)
+		{
+			return -1;		// the retries would never fit our slot
+		}
+		if(this->reliable.Pending() >= RELIABLE_SLOTS)
+		{
+			return -1;
+		}
+		LinkPeer* peer = this->links.FindOrAdd(dstAddress);
+		if(!peer->txReliable)
+		{
+			peer->txReliable = true;
+			peer->txSession = this->reliableSession++;
+			peer->txSeq = 0;
+		}
+		ReliableSlot* slot = this->reliable.Add(dstAddress, NextSeq(), peer->txSession, peer->txSeq + 1, outGoing.Data(), outGoing.Size());
+		if(slot == NULL)
+		{
+			return -1;
+		}
+		peer->txSeq++;
+		if(!this->transmitting)
+		{
+			SendTry(slot);
+		}
+		return slot->seq;		// else Service sends it
+	}
+
+	// the timeout covers the packet, the ack and the peer's turnaround, doubling each try
+	// with up to 50% random jitter so two senders that collided don't collide again
+	void LoraUtil::SendTry(ReliableSlot* slot)
+	{
+		SendControl(slot->dstAddress, LORA_CTRL_RELIABLE, slot->data.Data(), slot->data.Size(), slot->seq);
+		uint32_t air = this->lora->timeOnAir(slot->data.Size() + 5) + this->lora->timeOnAir(10);	// at the peer's rate now
+		uint32_t rto = (air / 1000 + RELIABLE_TURNAROUND_MS) << slot->tries;
+		slot->tries++;
+		slot->sentAt = millis();
+		slot->timeout = rto + random(rto / 2 + 1);
+	}
+
+	void LoraUtil::SetDeliveryCallback(DeliveryCallback callback)
+	{
+		this->deliveryCallback = callback;
+	}
+
+	int LoraUtil::ReliablePending()
+	{
+		return this->reliable.Pending();
+	}
+
+	// stream size bytes to dstAddress, reading them as needed. Service does the work;
+	// watch BulkSendStatus for BULK_DONE or BULK_FAILED
+	bool LoraUtil::SendBulk(uint8_t dstAddress, uint32_t size, BulkReader reader, void* context)
+	{
+		if(IsMulticast(dstAddress))
+		{
+			return false;
+		}
+		int fragment = BULK_FRAGMENT_SIZE;
+		if(this->tdmaRole != TDMA_OFF)
+		{
+			fragment = min(fragment, (int)this->tdmaFrameMax - (255 - BULK_FRAGMENT_MAX));	// fragments fit our slot
+		}
+		return fragment > 0 && this->bulk.Start(dstAddress, size, reader, context, fragment);
+	}
+
+	uint8_t LoraUtil::BulkSendStatus()
+	{
+		return this->bulk.SendStatus();
+	}
+
+	uint32_t LoraUtil::BulkBytesAcked()
+	{
+		return this->bulk.BytesAcked();
+	}
+
+	void LoraUtil::SetBulkWriter(BulkWriter writer, void* context)
+	{
+		this->bulk.SetWriter(writer, context);
+	}
+
+	uint8_t LoraUtil::BulkReceiveStatus()
+	{
+		return this->bulk.ReceiveStatus();
+	}
+
+	// send a string. use hardcoded src, dst address
+	// with batching on this goes out with other messages, within the latency bound.
+	// If the batches can't take it, it's sent right away as it is without batching.
+	// With tdma on it waits for our slot, false if it can't
+	bool LoraUtil::SendString(const String& Content)
 	{
 		int l = Content.length();
 		TinyVector tv(l, 1);		// leave room for the null so toCharArray is happy
 		Content.toCharArray((char*)tv.Data(), l+1);
-		SendPacket(this->dstAddress, this->localAddress, tv);	// don't send the null, though
+		if(this->tdmaRole != TDMA_OFF)
+		{
+			return SendBatched(this->dstAddress, tv);
+		}
+		if(this->batchDelay == 0 || !SendBatched(this->dstAddress, tv))
+		{
+			SendPacket(this->dstAddress, this->localAddress, tv);	// don't send the null, though
+		}
+		return true;
+	}
+
+	// small messages are held for up to maxDelayMs and sent together as
+	// length-prefixed records in one packet. The receiver unpacks them into separate
+	// packets. 0 turns it off (after sending whatever is held, or Service does when the radio is free)
+	void LoraUtil::EnableBatching(uint16_t maxDelayMs)
+	{
+		if(maxDelayMs == 0)
+		{
+			FlushBatch();
+		}
+		this->batchDelay = maxDelayMs;
+	}
+
+	// queue a message for dstAddress. A batch goes to one destination, so a new
+	// destination or a full batch closes the held one and starts another. The
+	// closed one is sent now, or by Service once a frame on air is done. Only if
+	// it is still waiting from before is the message refused. With tdma on only
+	// Service sends, in our slot, and a batch is kept to the frame the slots are sized for
+	bool LoraUtil::SendBatched(uint8_t dstAddress, TinyVector& outGoing)
+	{
+		int size = outGoing.Size();
+		int limit = LORA_BATCH_MAX;
+		if(this->tdmaRole != TDMA_OFF)
+		{
+			limit = min(limit, (int)this->tdmaFrameMax - 5 - LORA_TRAILER_SIZE);
+		}
+		if(size > limit - 1)
+		{
+			if(this->transmitting || this->tdmaRole != TDMA_OFF)
+			{
+				return false;
+			}
+			SendPacket(dstAddress, this->localAddress, outGoing);	// too big to batch
+			return true;
+		}
+		if(this->batchLength > 0 && (dstAddress != this->batchDst || this->batchLength + 1 + size > limit))
+		{
+			if(!CloseBatch())
+			{
+				return false;
+			}
+		}
+		if(this->batchLength == 0)
+		{
+			this->batchDst = dstAddress;
+			this->batchStart = millis();
+		}
+		this->batch[this->batchLength] = size;
+		memcpy(this->batch + this->batchLength + 1, outGoing.Data(), size);
+		this->batchLength += 1 + size;
+		this->batchCount++;
+		return true;
+	}
+
+	// a batch of one goes as a plain packet, it's smaller and can carry a link report.
+	// While a frame is on air Service sends it afterwards, and with tdma on always
+	// does, in our slot. If an earlier batch is still waiting this one goes after it
+	void LoraUtil::FlushBatch()
+	{
+		if(this->batchLength == 0)
+		{
+			return;
+		}
+		if(this->sealedLength > 0 && !this->transmitting && this->tdmaRole == TDMA_OFF)
+		{
+			SendBatch();
+		}
+		CloseBatch();
+	}
+
+	// so the next message starts a new batch
+	bool LoraUtil::CloseBatch()
+	{
+		if(this->sealedLength > 0)
+		{
+			return false;
+		}
+		this->sealedDst = this->batchDst;
+		memcpy(this->sealed, this->batch, this->batchLength);
+		this->sealedLength = this->batchLength;
+		this->sealedCount = this->batchCount;
+		this->batchLength = 0;
+		this->batchCount = 0;
+		if(!this->transmitting && this->tdmaRole == TDMA_OFF)
+		{
+			SendBatch();
+		}
+		return true;
+	}
+
+	void LoraUtil::SendBatch()
+	{
+		if(this->sealedCount == 1)
+		{
+			BeginFrame(this->sealedDst, this->localAddress, NextSeq(), this->sealed[0]);
+			this->lora->writeFifo(this->sealed + 1, this->sealed[0]);
+			EndFrame(this->sealedDst, this->sealed[0], true);
+			this->rxAfterTx = true;			// as SendControl does
+		}
+		else
+		{
+			SendControl(this->sealedDst, LORA_CTRL_BATCH, this->sealed, this->sealedLength, NextSeq());
+		}
+		this->sealedLength = 0;
+		this->sealedCount = 0;
+	}
+
+	// with the mesh on we pass on mesh packets from other nodes, so SendMesh reaches
+	// nodes out of range. Every node remembers recent packets and relays each one at
+	// most once, within maxHops of its origin. Nodes that only send don't need it on
+	void LoraUtil::EnableMesh(bool enable, uint8_t maxHops)
+	{
+		this->meshEnabled = enable;
+		this->meshHops = maxHops;
+	}
+
+	// flood a packet to dstAddress through the mesh. It's delivered with srcAddress set to us
+	bool LoraUtil::SendMesh(uint8_t dstAddress, TinyVector& outGoing)
+	{
+		if(outGoing.Size() > MESH_FRAME_MAX - MESH_HEADER)
+		{
+			return false;
+		}
+		uint8_t frame[MESH_FRAME_MAX];
+		uint8_t seq = NextSeq();
+		frame[0] = this->meshHops;
+		frame[1] = this->localAddress;
+		frame[2] = seq;
+		frame[3] = dstAddress;
+		memcpy(frame + MESH_HEADER, outGoing.Data(), outGoing.Size());
+		SendControl(0xff, LORA_CTRL_MESH, frame, MESH_HEADER + outGoing.Size(), seq);
+		return true;
+	}
+
+	// a mesh packet from peer (the last hop). Deliver it if it's for us and queue
+	// the relay. Hearing a copy of one we're waiting to relay means a neighbour
+	// already did, so ours would only add airtime
+	void LoraUtil::ReceiveMesh(LinkPeer* peer, uint8_t* frame, int length)
+	{
+		if(length < MESH_HEADER || frame[1] == this->localAddress)
+		{
+			return;		// our own packet coming back
+		}
+		if(this->mesh.Duplicate(frame[1], frame[2]))
+		{
+			if(this->mesh.Cancel(frame[1], frame[2]))
+			{
+				LORA_TRACE("Mesh %d:%d relayed by %d, dropped ours", (int)frame[1], (int)frame[2], (int)peer->address);
+			}
+			return;
+		}
+		uint8_t dst = frame[3];
+		if(Accepts(dst))
+		{
+			uint8_t header[3] = { dst, frame[1], frame[2] };
+			DeliverPacket(header, frame + MESH_HEADER, length - MESH_HEADER, peer->lastHeard);
+			if(!IsMulticast(dst))
+			{
+				return;		// it was only for us
+			}
+		}
+		if(!this->meshEnabled || frame[0] <= 1)
+		{
+			return;
+		}
+		int snr = min(max(peer->heardSnr / 4, MESH_SNR_LOW), MESH_SNR_HIGH) - MESH_SNR_LOW;
+		uint32_t delay = (uint32_t)MESH_DELAY_MS * snr / (MESH_SNR_HIGH - MESH_SNR_LOW) + random(MESH_JITTER_MS);
+		MeshRelay* relay = this->mesh.Queue(frame, length, millis() + delay);
+		if(relay != NULL)
+		{
+			relay->frame[0]--;
+		}
+	}
+
+	void LoraUtil::ServiceMesh()
+	{
+		if(this->transmitting)
+		{
+			return;
+		}
+		MeshRelay* relay = this->mesh.Due(millis());
+		if(relay != NULL)
+		{
+			if(FitsSlot(5 + relay->length))
+			{
+				SendControl(0xff, LORA_CTRL_MESH, relay->frame, relay->length, NextSeq());
+			}
+			else
+			{
+				LORA_DEBUG("Mesh relay too long for the slot");	// larger than the slots are sized for
+			}
+			this->mesh.Free(relay);
+		}
+	}
+
+	// a tdma node sends only in slot 1 + (address % slots) of the schedule the coordinator
+	// beacons. SendString and SendBatched messages wait for the slot, and so does anything
+	// Service sends. Between slot 0 (the beacon and coordinator traffic) and our slot
+	// the radio sleeps. SendPacket ignores the schedule. Everything stays at the default
+	// rate and full power, so adr and tpc are turned off
+	void LoraUtil::EnableTdma(bool enable)
+	{
+		if(enable)
+		{
+			EnableAdr(false, this->adrMargin / 4, this->adrMaxBandwidth);
+			EnableTpc(false, this->tpcMargin / 4, this->tpcMinPower);
+		}
+		this->tdmaRole = enable ? TDMA_NODE : TDMA_OFF;
+		this->tdmaSynced = false;
+		this->tdmaBeaconHeard = false;
+		if(!this->transmitting)
+		{
+			Listen();		// for the beacon, or back to normal
+		}
+	}
+
+	// beacon a schedule for slots nodes. Slots are sized so a maxFrame byte frame (header
+	// included) fits with the guards a node needs by the time it gives up on beacons.
+	// The coordinator's own traffic goes in slot 0, after the beacon. Adr and tpc are
+	// turned off as for a node
+	void LoraUtil::EnableTdmaCoordinator(uint8_t slots, uint8_t maxFrame)
+	{
+		if(slots == 0)
+		{
+			this->tdmaRole = TDMA_OFF;
+			return;
+		}
+		EnableAdr(false, this->adrMargin / 4, this->adrMaxBandwidth);
+		EnableTpc(false, this->tpcMargin / 4, this->tpcMinPower);
+		this->tdmaSlots = slots;
+		this->tdmaFrameMax = maxFrame;
+		this->tdmaFrameMs = this->lora->timeOnAir(maxFrame) / 1000 + 1;
+		this->tdmaBeaconMs = this->lora->timeOnAir(LORA_BEACON_SIZE) / 1000 + 1;
+		uint32_t slotMs = this->tdmaFrameMs + 2 * (TDMA_GUARD_MS + 1);
+		uint32_t drift = slotMs * (slots + 1) * TDMA_MAX_MISSED / (1000000 / TDMA_DRIFT_PPM) + 1;
+		slotMs += 2 * drift;
+		this->tdmaSlotMs = min(slotMs, (uint32_t)65535);
+		this->tdmaStart = millis() - this->tdmaBeaconMs - (uint32_t)(slots + 1) * this->tdmaSlotMs;	// beacon right away
+		this->tdmaRole = TDMA_COORDINATOR;
+	}
+
+	uint16_t LoraUtil::TdmaSlotMs()
+	{
+		return (this->tdmaRole == TDMA_COORDINATOR || this->tdmaSynced) ? this->tdmaSlotMs : 0;
+	}
+
+	// keep the schedule. A node times the period from the last beacon it heard (the
+	// receive time less its time on air) and keeps a guard at each end of its slot that
+	// grows with the beacon's age. Returns true if a frame can start now
+	bool LoraUtil::ServiceTdma()
+	{
+		uint32_t now = millis();
+		this->tdmaSendMs = 0;
+		if(this->tdmaRole == TDMA_COORDINATOR)
+		{
+			uint32_t period = this->tdmaBeaconMs + (uint32_t)(this->tdmaSlots + 1) * this->tdmaSlotMs;
+			if(this->transmitting)
+			{
+				return false;
+			}
+			if(now - this->tdmaStart >= period)
+			{
+				uint8_t body[4] = { this->tdmaSlots, (uint8_t)(this->tdmaSlotMs & 0xff), (uint8_t)(this->tdmaSlotMs >> 8), this->tdmaFrameMax };
+				this->tdmaStart = now;
+				SendControl(0xff, LORA_CTRL_BEACON, body, sizeof(body), NextSeq());
+				return false;
+			}
+			uint32_t elapsed = now - this->tdmaStart + TDMA_GUARD_MS;
+			uint32_t slotEnd = this->tdmaBeaconMs + this->tdmaSlotMs;
+			this->tdmaSendMs = (elapsed < slotEnd) ? slotEnd - elapsed : 0;
+			return this->tdmaFrameMs <= this->tdmaSendMs;
+		}
+		if(this->tdmaBeaconHeard)
+		{
+			this->tdmaBeaconHeard = false;
+			this->tdmaBeaconMs = this->lora->timeOnAir(LORA_BEACON_SIZE) / 1000 + 1;
+			this->tdmaStart = this->tdmaBeaconAt - this->tdmaBeaconMs;
+			this->tdmaFrameMs = this->lora->timeOnAir(this->tdmaFrameMax) / 1000 + 1;
+			this->tdmaSynced = true;
+		}
+		if(!this->tdmaSynced || this->transmitting)
+		{
+			return false;
+		}
+		uint32_t period = this->tdmaBeaconMs + (uint32_t)(this->tdmaSlots + 1) * this->tdmaSlotMs;
+		uint32_t age = now - this->tdmaStart;
+		if(age >= period * TDMA_MAX_MISSED)
+		{
+			LORA_INFO("Lost the tdma beacon");
+			this->tdmaSynced = false;
+			Listen();
+			return false;
+		}
+		uint32_t phase = age % period;
+		uint32_t guard = TDMA_GUARD_MS + 1 + age / (1000000 / TDMA_DRIFT_PPM);
+		uint32_t slotStart = this->tdmaBeaconMs + (uint32_t)(1 + this->localAddress % this->tdmaSlots) * this->tdmaSlotMs;
+		uint32_t slotEnd = slotStart + this->tdmaSlotMs;
+		if(phase >= slotStart + guard && phase + guard < slotEnd)
+		{
+			this->tdmaSendMs = slotEnd - guard - phase;
+		}
+		bool inSlot = this->tdmaFrameMs <= this->tdmaSendMs;
+		bool listen = phase < this->tdmaBeaconMs + this->tdmaSlotMs + guard || phase + guard >= period;
+		if(listen && this->radioAsleep)
+		{
+			Listen();
+		}
+		else if(!listen && !this->radioAsleep)
+		{
+			this->rxAfterTx = false;
+			this->lora->sleep();		// sending wakes it
+			this->radioAsleep = true;
+		}
+		return inSlot;
+	}
+
+	// Service only sends when a frame of tdmaFrameMax bytes fits, so this only
+	// stops longer ones. frameLength is the whole frame, header included
+	bool LoraUtil::FitsSlot(int frameLength)
+	{
+		return this->tdmaRole == TDMA_OFF || this->lora->timeOnAir(frameLength) / 1000 + 1 <= this->tdmaSendMs;
+	}
+
+	// a reference sends sync packets and its micros() becomes everyone's synced clock.
+	// Nodes fit the reference's time against their own from the packets they hear, and
+	// relaying nodes send their own once synced so the time spreads past one hop.
+	// A node only takes the time from senders nearer the reference than itself
+	void LoraUtil::EnableTimeSync(uint8_t role, bool relay)
+	{
+		this->syncRole = role;
+		this->syncRelay = relay;
+		this->syncDepth = (role == TIMESYNC_REFERENCE) ? 0 : TIMESYNC_UNSYNCED;
+		this->syncSentValid = false;
+		this->syncAwaitingTx = false;
+		this->syncLastSend = millis() - random(TIMESYNC_PERIOD_MS);	// spread the senders out
+		this->timeSync.Clear();
+	}
+
+	bool LoraUtil::TimeSynced()
+	{
+		return this->syncRole == TIMESYNC_REFERENCE || (this->syncRole == TIMESYNC_NODE && this->syncDepth != TIMESYNC_UNSYNCED && this->timeSync.Points() >= TIMESYNC_MIN_POINTS);
+	}
+
+	uint32_t LoraUtil::SyncedMicros()
+	{
+		return ToSyncedMicros(micros());
+	}
+
+	uint32_t LoraUtil::ToSyncedMicros(uint32_t localMicros)
+	{
+		return (this->syncRole == TIMESYNC_NODE) ? this->timeSync.ToGlobal(localMicros) : localMicros;
+	}
+
+	// a sync packet. Remember when it ended and, if we heard this sender's previous
+	// one, pair when that ended here with the synced time it says it ended
+	void LoraUtil::ReceiveSync(LinkPeer* peer, const uint8_t* body)
+	{
+		uint8_t depth = body[0];
+		uint32_t endMicros = this->lora->lastPacketInfo().endMicros;
+		uint32_t previous = peer->syncMicros;
+		bool paired = peer->syncValid && body[2] == peer->syncSeq && body[2] != body[1]
+				&& (endMicros - previous) < (uint32_t)TIMESYNC_PERIOD_MS * 1000 * TIMESYNC_TIMEOUT_PERIODS;
+		peer->syncValid = true;
+		peer->syncSeq = body[1];
+		peer->syncMicros = endMicros;
+		if(!paired || depth >= this->syncDepth)
+		{
+			return;
+		}
+		uint32_t global = body[3] | ((uint32_t)body[4] << 8) | ((uint32_t)body[5] << 16) | ((uint32_t)body[6] << 24);
+		this->timeSync.AddPoint(previous, global);
+		this->syncDepth = depth + 1;
+		this->syncLastPoint = millis();
+	}
+
+	void LoraUtil::ServiceTimeSync()
+	{
+		uint32_t now = millis();
+		if(this->syncRole == TIMESYNC_NODE)
+		{
+			this->timeSync.Update();
+			if(this->syncDepth != TIMESYNC_UNSYNCED && (now - this->syncLastPoint) > (uint32_t)TIMESYNC_PERIOD_MS * TIMESYNC_TIMEOUT_PERIODS)
+			{
+				LORA_INFO("Lost time sync");
+				this->syncDepth = TIMESYNC_UNSYNCED;
+				this->timeSync.Clear();
+			}
+			if(!this->syncRelay || !TimeSynced())
+			{
+				return;
+			}
+		}
+		if(this->transmitting || this->syncAwaitingTx || (now - this->syncLastSend) < TIMESYNC_PERIOD_MS)
+		{
+			return;
+		}
+		uint8_t seq = NextSeq();
+		uint8_t body[7];
+		body[0] = this->syncDepth;
+		body[1] = seq;
+		body[2] = this->syncSentValid ? this->syncSentSeq : seq;		// the same seq means no previous
+		uint32_t previous = ToSyncedMicros(this->syncSentMicros);
+		for(int i = 0; i < 4; i++)
+		{
+			body[3 + i] = (previous >> (8 * i)) & 0xff;
+		}
+		this->syncSentSeq = seq;
+		this->syncSentValid = false;
+		this->syncAwaitingTx = true;		// _doTransmit records when it ends
+		this->syncLastSend = now;
+		SendControl(0xff, LORA_CTRL_SYNC, body, sizeof(body), seq);
+	}
+
+	// telemetry mode sends fixed size frames with no PHY header and a two byte
+	// [src][seq] header, for the shortest airtime. Both ends must agree on the payload
+	// size, rate and crc setting up front. sf 6 only works this way. Adr and tpc
+	// need normal packets so they are turned off, and only SendTelemetry should
+	// be used while it's on. 0 goes back to normal packets at the default rate
+	bool LoraUtil::EnableTelemetry(uint8_t payloadSize, uint8_t sf)
+	{
+		if(payloadSize > 255 - LORA_TELEMETRY_HEADER || (sf != 0 && (sf < 6 || sf > 12)))
+		{
+			return false;
+		}
+		if(payloadSize > 0)
+		{
+			EnableAdr(false, this->adrMargin / 4, this->adrMaxBandwidth);
+			EnableTpc(false, this->tpcMargin / 4, this->tpcMinPower);
+		}
+		this->telemetrySize = payloadSize;
+		this->lora->setHeaderFilter(payloadSize > 0 ? 0 : 1);		// telemetry frames have no destination
+		uint8_t rate = (payloadSize > 0 && sf != 0) ? sf : this->defaultSf;
+		this->lora->standby();
+		if(rate != this->radioSf)
+		{
+			this->radioSf = rate;
+			this->lora->setSpreadingFactor(rate);
+		}
+		Listen();
+		return true;
+	}
+
+	// send one telemetry frame. Shorter data is zero padded
+	bool LoraUtil::SendTelemetry(const uint8_t* data, int length)
+	{
+		if(this->telemetrySize == 0)
+		{
+			return false;
+		}
+		uint8_t frame[255];
+		int size = LORA_TELEMETRY_HEADER + this->telemetrySize;
+		length = min(length, (int)this->telemetrySize);
+		frame[0] = this->localAddress;
+		frame[1] = NextSeq();
+		memcpy(frame + LORA_TELEMETRY_HEADER, data, length);
+		memset(frame + LORA_TELEMETRY_HEADER + length, 0, this->telemetrySize - length);
+		this->lora->beginPacket(true);		// the payload length register is the frame size
+		this->doneTransmit = false;
+		this->transmitting = true;
+		this->lora->writeFifo(frame, size);
+		this->lora->endPacket();
+		return true;
 	}
 
 	bool LoraUtil::IsPacketAvailable()
 	{
-		return (this->packet!=NULL) ? true : false;
+		return this->rxHead != this->rxTail;
 	}
 
-	// returns the current packet, which must be deleted by the caller
+	// returns the oldest received packet (or NULL), which must be deleted by the caller
 	LoraPacket* LoraUtil::ReadPacket()
 	{
-		// return the current packet (or none) and clear it out
-		LoraPacket* pkt = this->packet;
-		this->packet = NULL;
+		if(this->rxHead == this->rxTail)
+		{
+			return NULL;
+		}
+		LoraPacket* pkt = this->rxQueue[this->rxTail];
+		this->rxTail = (this->rxTail + 1) % LORA_RX_QUEUE;
 		return pkt;
 	}
 
+	uint32_t LoraUtil::DroppedPackets(bool doClear)
+	{
+		uint32_t dropped = this->rxDropped;
+		if(doClear)
+		{
+			this->rxDropped = 0;
+		}
+		return dropped;
+	}
+
 	void LoraUtil::DumpRegisters()
 	{
 		this->lora->dumpRegisters();
 	}
 
+	// the spi controller is static so this works on an uninitialized LoraUtil
+	void LoraUtil::SetSpiTrace(SpiTrace* trace)
+	{
+		_MySpiControl.SetTrace(trace);
+	}
+
 	uint32_t LoraUtil::GetLastReceivedTime(void)
 	{
 		return this->lora->getLastReceivedTime();
@@ -260,3 +1865,36 @@ static const StringPair LoraParameters[] = {{"tx_power_level", 5},
 		return this->lora->getLastSentTime();
 	}
 
+	uint32_t LoraUtil::GetLastReceivedMicros(void)
+	{
+		return this->lora->getLastReceivedMicros();
+	}
+
+	uint32_t LoraUtil::GetLastSentMicros(void)
+	{
+		return this->lora->getLastSentMicros();
+	}
+
+	// forward a received packet to the host as a HOSTLINK_PACKET frame
+	// turn on ASeries.SetFramed(true) first so the log text is framed too
+	void LoraUtil::ForwardToHost(const LoraPacket* pkt, uint8_t radioId)
+	{
+		if(pkt == NULL)
+		{
+			return;
+		}
+		HostLinkPacket hlp;
+		hlp.radioId = radioId;
+		hlp.dstAddress = pkt->dstAddress;
+		hlp.srcAddress = pkt->srcAddress;
+		hlp.srcLineCount = pkt->srcLineCount;
+		hlp.rssi = pkt->rssi;
+		hlp.snrQuarter = (int16_t)(pkt->snr * 4);
+		hlp.freqError = pkt->freqError;
+		hlp.timeMs = pkt->rxTime;
+		hlp.payLength = min((int)pkt->payLength, HOSTLINK_MAX_BODY - HOSTLINK_PACKET_HEADER);
+		hlp.payload = pkt->payload;
+		uint8_t body[HOSTLINK_MAX_BODY];
+		size_t len = HostLink::EncodePacket(hlp, body, sizeof(body));
+		ASeries.WriteFrame(HOSTLINK_PACKET, body, len);
+	}
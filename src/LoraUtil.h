@@ -3,8 +3,117 @@
 
 #include "Sx127x.h"
 #include "StringPair.h"
+#include "LinkTable.h"
+#include "ReliableQueue.h"
+#include "BulkTransfer.h"
+#include "MeshFlood.h"
+#include "TimeSync.h"
+
+// automatic frequency correction tuning
+#define AFC_FILTER_SHIFT 2			// each fei sample moves the estimate 1/4 of the way
+#define AFC_MIN_SAMPLES 2			// don't correct on a single packet
+#define AFC_HYSTERESIS_HZ 250		// ignore changes smaller than this (a few Frf steps)
+#define AFC_TEMP_CHECK_MS 30000		// how often Service reads the chip temperature
+#define AFC_RECAL_DEGREES 5			// recalibrate when it has moved this many degrees C
+
+// adaptive data rate tuning
+#define ADR_MARGIN_DB 10			// default snr headroom over the demodulator floor
+#define ADR_STEP_UP_DB 3			// extra headroom before going faster, so we don't flap
+#define ADR_MIN_SAMPLES 6			// packets heard at a rate before judging it
+#define ADR_REPLY_MS 3000			// give up on an unanswered request (and wait this long between them)
+#define ADR_MAX_UNANSWERED 6		// sends without hearing back before returning to the default rate
+#define ADR_SILENT_MS 300000		// or this long without hearing the peer at all
+
+// transmit power control tuning
+#define TPC_MARGIN_DB 6				// default margin to hold at the peer
+#define TPC_STEP_DB 2				// ignore smaller corrections
+#define TPC_MIN_REPORTS 2			// reports at a power level before changing it again
+#define TPC_MAX_UNANSWERED 3		// sends without hearing back before going to full power
+#define TPC_SNR_SATURATED 20		// 0.25 dB steps. Snr stops rising about here, so use rssi too
+
+// with tpc on, unicast data packets carry a link report after the payload (payLength doesn't
+// count it): [dB below our configured power][snr we last heard the dst with, 0.25 dB][-rssi]
+#define LORA_TRAILER_SIZE 3
+#define LORA_NO_REPORT -128
+
+// reliable delivery tuning
+#define RELIABLE_MAX_TRIES 4		// sends before giving up
+#define RELIABLE_TURNAROUND_MS 100	// allowance for the peer's loop to call Service and ack
+
+// mesh tuning. Relays wait longer the better they heard the packet, so the farthest goes first
+#define MESH_MAX_HOPS 4				// default hop limit for SendMesh
+#define MESH_DELAY_MS 300			// delay at MESH_SNR_HIGH and above
+#define MESH_JITTER_MS 60			// random extra, so relays that heard it alike don't collide
+#define MESH_SNR_LOW -20			// dB, at or below this there's only the jitter
+#define MESH_SNR_HIGH 10			// dB
+
+// tdma. A period is the coordinator's beacon then slots + 1 slots. Slot 0 is the coordinator's
+// and a node sends only in slot 1 + address % slots, sleeping when it isn't listening to slot 0
+#define TDMA_GUARD_MS 2				// beacon timing uncertainty (millis resolution, interrupt latency)
+#define TDMA_DRIFT_PPM 100			// both crystals together. Widens the guard as the last beacon ages
+#define TDMA_MAX_MISSED 4			// beacon periods without one before a node stops and listens
+
+enum TdmaRole
+{
+	TDMA_OFF = 0,
+	TDMA_NODE,
+	TDMA_COORDINATOR
+};
+
+// time sync. Each sync packet carries the synced time that the sender's previous one
+// ended on air, which a receiver pairs with when it heard that one end
+#define TIMESYNC_PERIOD_MS 30000	// between sync packets from each sender
+#define TIMESYNC_MIN_POINTS 2		// before a node counts as synced (and relays)
+#define TIMESYNC_TIMEOUT_PERIODS 4	// without a point before a node starts over
+#define TIMESYNC_UNSYNCED 255		// depth of a node that isn't synced
+
+enum TimeSyncRole
+{
+	TIMESYNC_OFF = 0,
+	TIMESYNC_NODE,
+	TIMESYNC_REFERENCE		// its micros() is the synced time
+};
+
+enum LoraCadState
+{
+	CAD_IDLE = 0,
+	CAD_RUNNING,
+	CAD_CLEAR,				// no preamble heard
+	CAD_BUSY				// someone is sending
+};
+
+#define LORA_STAGE_MAX 120			// StagePacket payload, so the frame fits the fifo's tx half
+
+#define LORA_RX_QUEUE 8				// received packets waiting for ReadPacket (one slot stays empty)
+#define LORA_BATCH_MAX 250			// record bytes in a batch packet
+
+// telemetry frames use an implicit PHY header and a size both ends agree on: [src][seq][payload]
+#define LORA_TELEMETRY_HEADER 2
+
+// multicast groups. Addresses from here up are groups, not nodes (0xff is everyone). One packet
+// reaches every member, so there are no acks, link reports or per-peer rates for them
+#define LORA_GROUP_FIRST 0xe0
+
+// control packets. The header length byte is LORA_CONTROL (a real payload is never that long)
+// and the first payload byte is the opcode. Only the data they carry reaches ReadPacket
+#define LORA_CONTROL 0xff
+#define LORA_CTRL_ADR_REQUEST 1		// [sf][bw/100 lsb][bw/100 msb] please switch to this rate
+#define LORA_CTRL_ADR_ACCEPT 2		// same body, switching as soon as this is sent
+#define LORA_CTRL_RELIABLE 3		// [session][seq][payload] data that wants an ack. Delivered like any packet
+#define LORA_CTRL_ACK 4				// [session][newest seq][mask lsb..msb] the sender's receive window from us
+#define LORA_RELIABLE_MAX 248		// SendReliable payload, so the frame fits
+// 5..8 are LORA_CTRL_BULK_xxx in BulkTransfer.h
+#define LORA_CTRL_BATCH 9			// [length][message]... several small messages
+#define LORA_CTRL_MESH 10			// [hops left][origin][origin seq][final dst][payload] sent to 0xff
+#define LORA_CTRL_BEACON 11			// [slots][slot ms lsb][slot ms msb][max frame] from the tdma coordinator
+#define LORA_BEACON_SIZE 9			// the whole beacon frame
+#define LORA_CTRL_SYNC 12			// [depth][seq][previous seq][previous end, synced us lsb..msb]
+
+// called from Service when a SendReliable packet is acked or runs out of tries
+typedef void (*DeliveryCallback)(uint8_t dstAddress, uint8_t seq, bool delivered);
 
 class SpiControl;
+class SpiTrace;
 class TinyVector;
 
 // LoraUtil converts incoming data into a LoraPacket. 
@@ -14,13 +123,21 @@ class LoraPacket
 {
 	public:
 		LoraPacket();
-		String msgTxt;
+		~LoraPacket();
+		String msgTxt;		// the payload as text, cut at any 0
+		uint8_t* payload;	// the raw payload, payLength bytes
 		uint8_t srcAddress;
 		uint8_t dstAddress;
 		uint8_t srcLineCount;
 		uint8_t payLength;
 		int rssi;
 		float snr;
+		int32_t freqError;	// Hz, from the chip's frequency error indicator
+		uint32_t rxTime;	// millis() at reception
+		uint32_t rxMicros;	// micros() when the packet ended on air
+	private:
+		LoraPacket(const LoraPacket&);		// owns payload, so no copies
+		LoraPacket& operator=(const LoraPacket&);
 };
 
 // The helper class. Construct, sendString, readPacket...
@@ -32,36 +149,205 @@ class LoraUtil : public LoraReceiver
 		void Initialize(int pinSS, int pinRST, int pinINT, const StringPair* params);
 		void SetFrequency(double newFreq);	// puts chip into standby first
 		void SetFrequencyOffset(int32_t offsetFreq);
+		void EnableAfc(bool enable);		// track each peer's frequency error and correct for it
+		int32_t GetPeerFrequencyError(uint8_t address);	// the filtered estimate (Hz), 0 if unknown
+		void EnableTpc(bool enable, int marginDb = TPC_MARGIN_DB, int minPower = 2);	// per peer power from its reports
+		int GetPeerTxPower(uint8_t address);		// dBm we send to it with
+		void EnableAdr(bool enable, int marginDb = ADR_MARGIN_DB, uint32_t maxBandwidth = 500000);	// pick a rate per peer from its snr
+		void Service();			// periodic work (afc, calibration, adr, tpc...). Call from the loop
+		LinkTable& Links();		// per-peer link state
 		String GetError(bool doClear = false);		// for errors that happened during interrupt
 		void Reset();		// reset the device
 		void Sleep();		// sleep the device
 		void WaitForPacket();	// go into receive mode
+		void EnableRxWindow(uint16_t windowMs);	// listen this long after each send then sleep, 0 = receive continuously
+		bool IsRxTimeout(bool forceClear = false);	// a receive window closed without a packet
+		void SetDioPins(int dio1Pin, int dio3Pin = NOPIN);	// optional DIO1/DIO3 interrupts, after Initialize
+		bool StartCad();		// look for a preamble on the channel, false while sending
+		uint8_t CadResult();	// LoraCadState. The radio waits in standby after a cad
 		// debug
 		void DumpRegisters();		// dump the sx1276 registers to serial
+		void SetSpiTrace(SpiTrace* trace);	// record spi traffic. Call before Initialize to get the init sequence
 		uint32_t GetLastReceivedTime(void);
 		uint32_t GetLastSentTime(void);
+		uint32_t GetLastReceivedMicros(void);	// end of the packet on air, from the interrupt edge
+		uint32_t GetLastSentMicros(void);
+		// gateway
+		void ForwardToHost(const LoraPacket* pkt, uint8_t radioId = 0);	// send a packet to the host as a binary frame
 		// send
 		void SendPacket(uint8_t dstAddress, uint8_t localAddress, TinyVector& outGoing);
-		void SendString(const String& content);
+		void EnableStaging(bool enable);		// packets up to LORA_STAGE_MAX can be loaded ahead
+		bool StagePacket(uint8_t dstAddress, TinyVector& outGoing);	// load the next packet now, then back to receive
+		bool SendStaged();			// send it, false if there isn't one (any other send replaces it)
+		bool SendString(const String& content);	// false only with tdma on, if it can't be held for our slot
+		void EnableBatching(uint16_t maxDelayMs);	// coalesce SendString/SendBatched messages, 0 = off
+		bool SendBatched(uint8_t dstAddress, TinyVector& outGoing);	// false if both batches are waiting on the radio
+		void FlushBatch();			// send any held messages now, or as soon as the radio is free
+		int SendReliable(uint8_t dstAddress, TinyVector& outGoing);	// acked and retried, -1 if too many in flight
+		void SetDeliveryCallback(DeliveryCallback callback);
+		int ReliablePending();		// SendReliable packets not yet acked or given up on
+		void EnableMesh(bool enable, uint8_t maxHops = MESH_MAX_HOPS);	// relay other nodes' mesh packets
+		bool SendMesh(uint8_t dstAddress, TinyVector& outGoing);	// flood to a node, group or everyone
+		void EnableTdma(bool enable);		// send only in our slot of the coordinator's schedule
+		void EnableTdmaCoordinator(uint8_t slots, uint8_t maxFrame = 64);	// beacon a schedule, 0 slots = off
+		uint16_t TdmaSlotMs();			// 0 until a node hears a beacon
+		void EnableTimeSync(uint8_t role, bool relay = true);	// TimeSyncRole. Relaying nodes pass the time on
+		bool TimeSynced();
+		uint32_t SyncedMicros();		// the reference's micros() now. Ours until synced
+		uint32_t ToSyncedMicros(uint32_t localMicros);	// e.g. a packet's rxMicros
+		bool EnableTelemetry(uint8_t payloadSize, uint8_t sf = 0);	// fixed size implicit header frames, 0 = off
+		bool SendTelemetry(const uint8_t* data, int length);	// padded or cut to the payload size
+		bool SendBulk(uint8_t dstAddress, uint32_t size, BulkReader reader, void* context = NULL);	// false if one is running
+		uint8_t BulkSendStatus();	// BulkStatus
+		uint32_t BulkBytesAcked();
+		void SetBulkWriter(BulkWriter writer, void* context = NULL);		// accept bulk transfers
+		uint8_t BulkReceiveStatus();	// BulkStatus
 		void SetAddresses(uint8_t dstAddress, uint8_t localAddress);		// define the device after initialize
+		void AddAddress(uint8_t address);		// also receive packets sent to this address
+		void RemoveAddress(uint8_t address);	// 0xff stops broadcasts
+		void SetPromiscuous(bool enable);		// receive everything, for gateways and sniffers
+		bool JoinGroup(uint8_t group);			// receive a multicast address, false if not one
+		void LeaveGroup(uint8_t group);
+		static bool IsMulticast(uint8_t address) { return address >= LORA_GROUP_FIRST; }	// a group or broadcast
 		bool IsPacketSent(bool forceClear = false);		// asynchronous transmit flag
 		// receive
 		LoraPacket* ReadPacket();
 		bool IsPacketAvailable();
+		uint32_t DroppedPackets(bool doClear = false);	// received while the queue was full
 		// these are public for use only by interrupt handler
 		virtual void _doReceive(TinyVector* payload);
 		virtual void _doTransmit();
+		virtual bool _acceptHeader(const uint8_t* header, int packetLength);
+		virtual void _doCadDone(bool detected);
+		virtual void _doRxTimeout();
 	private:
+		// the Sx127x callbacks. The qualified calls skip the vtable
+		static void OnReceive(void* context, uint8_t* data, int length, const LoraPacketInfo& info) { ((LoraUtil*)context)->ReceiveFrame(data, length); }
+		static void OnTransmit(void* context) { ((LoraUtil*)context)->LoraUtil::_doTransmit(); }
+		static bool OnHeader(void* context, const uint8_t* header, int packetLength) { return ((LoraUtil*)context)->LoraUtil::_acceptHeader(header, packetLength); }
+		void ReceiveFrame(uint8_t* data, int size);	// interrupt time
+		bool Accepts(uint8_t address) const { return (this->addressMap[address >> 3] & (1 << (address & 7))) != 0; }
 		void writeInt(uint8_t value);
+		void Listen();			// receive, sized for telemetry frames if that's on
+		LinkPeer* HeardFrom(uint8_t address, int backoff, uint32_t rxTime);	// interrupt time
+		uint8_t NextSeq();
+		void BeginFrame(uint8_t dstAddress, uint8_t localAddress, uint8_t seq, uint8_t lengthByte);
+		void EndFrame(uint8_t dstAddress, int size, bool canReport);
+		void WriteTrailer(uint8_t dstAddress, int size, bool canReport);
+		void TuneFor(uint8_t dstAddress);		// afc, rate and power for a peer, in standby
+		void SendControl(uint8_t dstAddress, uint8_t opcode, const uint8_t* body, int length, uint8_t seq);	// then back to receive
+		void HandleControl(LinkPeer* peer, uint8_t* frame, int size);	// interrupt time
+		void DeliverPacket(const uint8_t* header, uint8_t* payload, uint8_t length, uint32_t rxTime);
+		void SendTry(ReliableSlot* slot);
+		void ServiceReliable();
+		void ServiceBulk();
+		void ReceiveMesh(LinkPeer* peer, uint8_t* frame, int length);	// interrupt time
+		void ServiceMesh();
+		bool ServiceTdma();			// true when a frame can go out now
+		bool CloseBatch();			// move the held batch to sealed and send it if we can, false if sealed is taken
+		void SendBatch();			// the sealed batch
+		bool FitsSlot(int frameLength);	// false if a frame this long would run past our slot
+		void ReceiveSync(LinkPeer* peer, const uint8_t* body);	// interrupt time
+		void ServiceTimeSync();
+		void TrackFrequency(LinkPeer* peer, int32_t freqError);	// called on receive
+		void ApplyAfc(uint8_t dstAddress);		// retune for a peer, in standby
+		void CheckTemperature();
+		void ClearAfc();				// back to the static offset, in standby
+		void ServiceAdr();
+		void ServiceTpc();
+		void TrackReport(LinkPeer* peer, int8_t snrQuarter, uint8_t negRssi);	// interrupt time
+		void ApplyPower(uint8_t dstAddress);	// set the radio to a peer's power, in standby
+		int PeerPower(const LinkPeer* peer);
+		bool ChooseRate(LinkPeer* peer, uint8_t& sf, uint32_t& bw);
+		void SwitchRate(LinkPeer* peer, uint8_t sf, uint32_t bw);	// start using a new rate with a peer
+		void ApplyRate(uint8_t dstAddress);		// set the radio to a peer's rate, in standby
+		uint8_t PeerSf(const LinkPeer* peer);
+		uint32_t PeerBw(const LinkPeer* peer);
 		//
 		SpiControl* Spi();	// the SPI comm wrapper
 		Sx127x* Lora();		// the Sx1276 wrapper
 	private:
 		int linecounter;
-		LoraPacket* packet;
+		LoraPacket* rxQueue[LORA_RX_QUEUE];	// filled by the interrupt at rxHead, ReadPacket takes rxTail
+		volatile uint8_t rxHead;
+		volatile uint8_t rxTail;
+		volatile uint32_t rxDropped;
+		// batching
+		uint16_t batchDelay;		// ms, 0 = off
+		uint8_t batchDst;
+		uint32_t batchStart;		// millis() of the first held message
+		uint8_t batch[LORA_BATCH_MAX];
+		int batchLength;
+		int batchCount;
+		uint8_t sealedDst;			// a closed batch, waiting for the radio
+		uint8_t sealed[LORA_BATCH_MAX];
+		int sealedLength;
+		int sealedCount;
+		uint8_t telemetrySize;		// payload bytes in a telemetry frame, 0 = normal packets
 		volatile bool doneTransmit;
+		volatile bool transmitting;		// between SendPacket and the tx done interrupt
+		volatile uint8_t cadState;		// LoraCadState
+		bool stagingEnabled;
+		uint8_t stagedDst;
+		uint16_t rxWindowMs;			// 0 = continuous receive
+		volatile uint32_t rxWindowEnd;	// millis() by which any packet in the window is over
+		volatile bool rxTimedOut;
+		bool rxAfterTx;					// a control packet went out, Service goes back to receive
+		LinkTable links;
+		ReliableQueue reliable;
+		uint8_t reliableSession;		// the next LinkPeer txSession, random from boot
+		DeliveryCallback deliveryCallback;
+		BulkTransfer bulk;
+		MeshFlood mesh;
+		bool meshEnabled;
+		uint8_t meshHops;
+		// tdma
+		uint8_t tdmaRole;			// TdmaRole
+		uint8_t tdmaSlots;			// node slots, not counting the coordinator's
+		uint16_t tdmaSlotMs;
+		uint8_t tdmaFrameMax;		// largest frame the slots are sized for
+		uint32_t tdmaFrameMs;		// its time on air, rounded up
+		uint32_t tdmaSendMs;		// what's left of our slot, from the last ServiceTdma
+		uint32_t tdmaBeaconMs;		// the beacon's time on air, before slot 0
+		uint32_t tdmaStart;			// millis() the last beacon began
+		bool tdmaSynced;
+		bool radioAsleep;			// tdma put it to sleep
+		volatile bool tdmaBeaconHeard;
+		volatile uint32_t tdmaBeaconAt;	// receive time of the new beacon
+		// time sync
+		TimeSync timeSync;
+		uint8_t syncRole;			// TimeSyncRole
+		bool syncRelay;
+		volatile uint8_t syncDepth;	// hops from the reference
+		volatile uint32_t syncLastPoint;	// millis()
+		uint32_t syncLastSend;
+		uint8_t syncSentSeq;
+		bool syncSentValid;
+		uint32_t syncSentMicros;	// end of our last sync packet
+		volatile bool syncAwaitingTx;
+		// afc
+		bool afcEnabled;
+		int32_t baseOffset;			// the user's (static) frequency offset
+		volatile int32_t afcOffset;	// our current correction on top of that
+		uint8_t calTemperature;		// chip temperature at the last calibration
+		uint32_t lastTempCheck;
+		// tpc
+		bool tpcEnabled;
+		int tpcMargin;				// 0.25 dB steps
+		int tpcMinPower;
+		int configuredPower;		// from the init parameters, and our maximum
+		// adr
+		bool adrEnabled;
+		int adrMargin;				// 0.25 dB steps
+		uint32_t adrMaxBandwidth;
+		uint8_t defaultSf;			// from the init parameters
+		uint32_t defaultBw;
+		uint8_t radioSf;			// what the chip is set to now
+		uint32_t radioBw;
 		uint8_t dstAddress;
 		uint8_t localAddress;
+		uint8_t addressMap[32];		// destinations we receive, one bit each
+		bool promiscuous;
 
 		// init spi
 		SpiControl* spic;
@@ -0,0 +1,97 @@
+// --------------------------------------------------------------------
+// MeshFlood keeps the duplicate cache and the relay queue for LoraUtil
+// Fixed size, so memory doesn't grow with the number of nodes
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "MeshFlood.h"
+
+MeshFlood::MeshFlood()
+{
+	Clear();
+}
+
+void MeshFlood::Clear()
+{
+	_SeenCount = 0;
+	_SeenNext = 0;
+	for(int i = 0; i < MESH_RELAY_SLOTS; i++)
+	{
+		_Relays[i].state = MESH_FREE;
+	}
+}
+
+// interrupt time
+bool MeshFlood::Duplicate(uint8_t origin, uint8_t seq)
+{
+	uint16_t key = ((uint16_t)origin << 8) | seq;
+	for(int i = 0; i < _SeenCount; i++)
+	{
+		if(_Seen[i] == key)
+		{
+			return true;
+		}
+	}
+	_Seen[_SeenNext] = key;
+	_SeenNext = (_SeenNext + 1) % MESH_CACHE;
+	if(_SeenCount < MESH_CACHE)
+	{
+		_SeenCount++;
+	}
+	return false;
+}
+
+// interrupt time
+MeshRelay* MeshFlood::Queue(const uint8_t* frame, int length, uint32_t dueAt)
+{
+	if(length > MESH_FRAME_MAX)
+	{
+		return NULL;
+	}
+	for(int i = 0; i < MESH_RELAY_SLOTS; i++)
+	{
+		MeshRelay* relay = &_Relays[i];
+		if(relay->state == MESH_FREE)
+		{
+			memcpy(relay->frame, frame, length);
+			relay->length = length;
+			relay->dueAt = dueAt;
+			relay->state = MESH_WAITING;
+			return relay;
+		}
+	}
+	return NULL;
+}
+
+// interrupt time
+bool MeshFlood::Cancel(uint8_t origin, uint8_t seq)
+{
+	for(int i = 0; i < MESH_RELAY_SLOTS; i++)
+	{
+		MeshRelay* relay = &_Relays[i];
+		if(relay->state == MESH_WAITING && relay->frame[1] == origin && relay->frame[2] == seq)
+		{
+			relay->state = MESH_FREE;
+			return true;
+		}
+	}
+	return false;
+}
+
+MeshRelay* MeshFlood::Due(uint32_t now)
+{
+	for(int i = 0; i < MESH_RELAY_SLOTS; i++)
+	{
+		MeshRelay* relay = &_Relays[i];
+		if(relay->state == MESH_WAITING && (int32_t)(now - relay->dueAt) >= 0)
+		{
+			relay->state = MESH_SENDING;		// so a late Cancel leaves it alone
+			return relay;
+		}
+	}
+	return NULL;
+}
+
+void MeshFlood::Free(MeshRelay* relay)
+{
+	relay->state = MESH_FREE;
+}
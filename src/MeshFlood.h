@@ -0,0 +1,54 @@
+#ifndef MESH_FLOOD_H
+#define MESH_FLOOD_H
+
+#include <stdint.h>
+
+// A managed flood for LoraUtil. A node that hears a mesh packet for the first time
+// passes it on once, with one hop less to go, after a short delay. If it hears
+// another node pass the same packet on first, it drops its own copy. The receive
+// interrupt fills this in; LoraUtil::Service sends whatever is due.
+
+#ifndef MESH_CACHE
+#define MESH_CACHE 16				// (origin, seq) pairs remembered, oldest replaced first
+#endif
+#ifndef MESH_RELAY_SLOTS
+#define MESH_RELAY_SLOTS 2			// packets waiting to be passed on
+#endif
+#define MESH_HEADER 4				// [hops left][origin][origin seq][final dst]
+#define MESH_FRAME_MAX 250			// mesh header + payload, what fits in a control packet
+
+enum MeshRelayState
+{
+	MESH_FREE = 0,
+	MESH_WAITING,			// heard, waiting for its delay
+	MESH_SENDING			// Service has it
+};
+
+class MeshRelay
+{
+	public:
+		volatile uint8_t state;		// MeshRelayState
+		uint32_t dueAt;				// millis() to send it
+		uint8_t length;
+		uint8_t frame[MESH_FRAME_MAX];	// mesh header + payload, hops already decremented
+};
+
+class MeshFlood
+{
+	public:
+		MeshFlood();
+		void Clear();
+		bool Duplicate(uint8_t origin, uint8_t seq);	// true if seen before, else remembers it
+		MeshRelay* Queue(const uint8_t* frame, int length, uint32_t dueAt);	// NULL if full
+		bool Cancel(uint8_t origin, uint8_t seq);		// someone else relayed it. true if we had it
+		MeshRelay* Due(uint32_t now);					// the next one to send, or NULL
+		void Free(MeshRelay* relay);
+
+	private:
+		uint16_t _Seen[MESH_CACHE];		// origin << 8 | seq
+		uint8_t _SeenCount;
+		uint8_t _SeenNext;
+		MeshRelay _Relays[MESH_RELAY_SLOTS];
+};
+
+#endif // MESH_FLOOD_H
@@ -0,0 +1,99 @@
+// --------------------------------------------------------------------
+// ReliableQueue holds unacknowledged packets for LoraUtil
+// The data buffers are allocated on first use and then reused
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "ReliableQueue.h"
+
+ReliableQueue::ReliableQueue()
+{
+	Clear();
+}
+
+void ReliableQueue::Clear()
+{
+	for(int i = 0; i < RELIABLE_SLOTS; i++)
+	{
+		_Slots[i].state = RELIABLE_FREE;
+	}
+}
+
+ReliableSlot* ReliableQueue::Add(uint8_t dstAddress, uint8_t seq, uint8_t session, uint8_t reliableSeq, const uint8_t* data, int length)
+{
+	for(int i = 0; i < RELIABLE_SLOTS; i++)
+	{
+		ReliableSlot* slot = &_Slots[i];
+		if(slot->state == RELIABLE_FREE)
+		{
+			slot->data.Allocate(length + 2);
+			slot->data.Data()[0] = session;
+			slot->data.Data()[1] = reliableSeq;
+			memcpy(slot->data.Data() + 2, data, length);
+			slot->dstAddress = dstAddress;
+			slot->seq = seq;
+			slot->session = session;
+			slot->reliableSeq = reliableSeq;
+			slot->tries = 0;
+			slot->sentAt = millis();
+			slot->timeout = 0;
+			slot->state = RELIABLE_WAITING;
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+// interrupt time
+int ReliableQueue::Acknowledge(uint8_t srcAddress, uint8_t session, uint8_t seqHigh, uint32_t seqMask)
+{
+	int count = 0;
+	for(int i = 0; i < RELIABLE_SLOTS; i++)
+	{
+		ReliableSlot* slot = &_Slots[i];
+		if(slot->state == RELIABLE_WAITING && slot->dstAddress == srcAddress && slot->session == session &&
+				InWindow(seqHigh, seqMask, slot->reliableSeq))
+		{
+			slot->state = RELIABLE_ACKED;
+			count++;
+		}
+	}
+	return count;
+}
+
+void ReliableQueue::Free(ReliableSlot* slot)
+{
+	slot->state = RELIABLE_FREE;
+}
+
+int ReliableQueue::Pending()
+{
+	int count = 0;
+	for(int i = 0; i < RELIABLE_SLOTS; i++)
+	{
+		if(_Slots[i].state != RELIABLE_FREE)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+ReliableSlot* ReliableQueue::At(int index)
+{
+	if(index < 0 || index >= RELIABLE_SLOTS || _Slots[index].state == RELIABLE_FREE)
+	{
+		return NULL;
+	}
+	return &_Slots[index];
+}
+
+// bit n of the mask is seqHigh - 1 - n
+bool ReliableQueue::InWindow(uint8_t seqHigh, uint32_t seqMask, uint8_t seq)
+{
+	uint8_t back = seqHigh - seq;
+	if(back == 0)
+	{
+		return true;
+	}
+	return back <= RELIABLE_WINDOW && (seqMask & ((uint32_t)1 << (back - 1))) != 0;
+}
@@ -0,0 +1,53 @@
+#ifndef RELIABLE_QUEUE_H
+#define RELIABLE_QUEUE_H
+
+#include "TinyVector.h"
+
+// Packets sent with LoraUtil::SendReliable wait here until the destination
+// acknowledges them or we run out of tries. Acks arrive in the receive interrupt,
+// which only flips a slot's state; LoraUtil::Service does the rest.
+
+#ifndef RELIABLE_SLOTS
+#define RELIABLE_SLOTS 4			// packets in flight, across all destinations
+#endif
+#define RELIABLE_WINDOW 32			// sequence numbers covered by an ack (the newest plus a bitmap)
+
+enum ReliableState
+{
+	RELIABLE_FREE = 0,
+	RELIABLE_WAITING,		// sent, no ack yet
+	RELIABLE_ACKED			// acked, Service reports it and frees the slot
+};
+
+class ReliableSlot
+{
+	public:
+		volatile uint8_t state;		// ReliableState
+		uint8_t dstAddress;
+		uint8_t seq;				// the header line count, the same on every try
+		uint8_t session;			// the destination's LinkPeer txSession
+		uint8_t reliableSeq;		// what the ack window counts, per destination
+		uint8_t tries;
+		uint32_t sentAt;			// millis() of the last try
+		uint32_t timeout;			// ms after sentAt to try again
+		TinyVector data;			// [session][reliableSeq][payload], kept for retries
+};
+
+class ReliableQueue
+{
+	public:
+		ReliableQueue();
+		void Clear();
+		ReliableSlot* Add(uint8_t dstAddress, uint8_t seq, uint8_t session, uint8_t reliableSeq, const uint8_t* data, int length);	// NULL if full
+		int Acknowledge(uint8_t srcAddress, uint8_t session, uint8_t seqHigh, uint32_t seqMask);	// returns how many it acked
+		void Free(ReliableSlot* slot);
+		int Pending();							// slots in use
+		ReliableSlot* At(int index);			// iterate, NULL if free
+		// a receive window: the newest sequence number and a bitmap of the RELIABLE_WINDOW before it
+		static bool InWindow(uint8_t seqHigh, uint32_t seqMask, uint8_t seq);
+
+	private:
+		ReliableSlot _Slots[RELIABLE_SLOTS];
+};
+
+#endif // RELIABLE_QUEUE_H
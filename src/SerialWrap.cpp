@@ -1,5 +1,7 @@
 #include "Arduino.h"
 #include "SerialWrap.h"
+#include "IrqGuard.h"
+#include "HostLink.h"
 #include <stdarg.h>     /* va_list, va_start, va_arg, va_end */
 
 // This is just a Serial wrapper. The standard Serial interface should not be used.
@@ -8,9 +10,14 @@
 // So this ensures that the Serial I/O does not cause failures
 // It also prepends a header to every println with server name and time
 // call the static Serial wrapper "ASeries" so it's easy to search for Serial without a hit
+// Output is never written to Serial directly. Each line is copied whole into a fixed ring
+// and Drain (called from the loop, and opportunistically by println outside interrupts)
+// hands Serial only as many bytes as it can take without blocking.
+// In logging mode the same ring is a bounded history that overwrites its oldest bytes.
 
 static bool _UseSerial = true;			// set to false to disable serial i/o
 static bool _WaitForSerial = false;		// this will halt until Serial is available
+static bool _MicroTime = false;			// default time stamps end in microseconds
 
 static String PROG_NAME("Server");
 SerialWrap ASeries(PROG_NAME);
@@ -22,7 +29,11 @@ SerialWrap ASeries(PROG_NAME);
 SerialWrap::SerialWrap(String& caller)
 {
 	_IsLogging = false;
+	_IsFramed = false;
 	_DidInit = false;		// only initialize serial once
+	_Head = 0;
+	_Tail = 0;
+	_Dropped = 0;
 	_Caller = caller;		// for logging
 	_Baudrate = 115200;		// default baudrate=115200
 	SetFormatter(NULL);		// default time formatter
@@ -39,7 +50,7 @@ void SerialWrap::SetFormatter(SerialTimeFormatter timeFormatter)
 	}
 	else
 	{
-		_TimeFormatter = SerialWrap::getStrTime;	// use millis
+		_TimeFormatter = SerialWrap::FormatTime;	// use millis
 	}
 }
 
@@ -58,7 +69,7 @@ bool SerialWrap::isLogging()
 }
 
 // for places where we want to keep sending to serial i/o but there is none.
-// turn on logging to put stuff into the _SerialLog object
+// turn on logging to keep the output in the ring as a circular history
 // it returns the current Log if doLog is false
 // it clears the current log (so ignore result) if doLog is true
 String SerialWrap::setLogging(bool doLog)
@@ -68,30 +79,228 @@ String SerialWrap::setLogging(bool doLog)
 		// let us call this with true to get the log repeatedly
 		if(!_IsLogging)
 		{
+			IrqGuard guard;
 			_IsLogging = true;
-			_SerialLog = "";
+			_Tail = _Head;		// start a fresh history
 		}
+		return History();
 	}
-	else
+
+	String log = History();
 	{
+		IrqGuard guard;
 		_IsLogging = false;
-		InitIfNeeded();
+		_Tail = _Head;			// the history was handed back, don't send it to Serial
 	}
-	return _SerialLog;
+	InitIfNeeded();
+	return log;
 }
 
-// Serial mimic methods
-size_t SerialWrap::println(const char* spout)
+// bytes waiting in the ring
+size_t SerialWrap::Queued()
+{
+	return (uint16_t)(_Head - _Tail);
+}
+
+// copy the ring contents into a String (for the logging mode)
+String SerialWrap::History()
+{
+	String log;
+	IrqGuard guard;
+	size_t count = Queued();
+	log.reserve(count);
+	for(uint16_t i = _Tail; count > 0; count--, i++)
+	{
+		log += _Ring[i & (SERIALWRAP_RING_SIZE - 1)];
+	}
+	return log;
+}
+
+// add a line to the ring. Lines are never split: if it doesn't fit it is dropped
+// and counted. In logging mode the oldest bytes are discarded to make room instead.
+// interrupts are masked only for the copy so the loop and a handler can both log.
+size_t SerialWrap::Enqueue(const char* data, size_t len)
+{
+	if(len > SERIALWRAP_RING_SIZE)
+	{
+		len = SERIALWRAP_RING_SIZE;
+	}
+
+	IrqGuard guard;
+	size_t room = SERIALWRAP_RING_SIZE - Queued();
+	if(len > room)
+	{
+		if(!_IsLogging)
+		{
+			_Dropped++;
+			return 0;
+		}
+		_Tail += (len - room);	// forget the oldest history
+	}
+	uint16_t head = _Head;
+	for(size_t i = 0; i < len; i++, head++)
+	{
+		_Ring[head & (SERIALWRAP_RING_SIZE - 1)] = data[i];
+	}
+	_Head = head;
+	return len;
+}
+
+// move what Serial can accept right now from the ring to the port.
+// never blocks. Returns the number of bytes written.
+size_t SerialWrap::Drain(size_t maxBytes)
+{
+	if(_IsLogging || !_UseSerial || !Serial)
+	{
+		return 0;
+	}
+	InitIfNeeded();		// Serial is up so this won't wait
+	if(!_DidInit)
+	{
+		return 0;
+	}
+
+	size_t written = 0;
+	while(written < maxBytes)
+	{
+		size_t count = Queued();		// only we move _Tail so this is stable
+		int room = Serial.availableForWrite();
+		if(count == 0 || room <= 0)
+		{
+			break;
+		}
+		// the contiguous run up to the end of the ring
+		uint16_t tail = _Tail;
+		size_t index = tail & (SERIALWRAP_RING_SIZE - 1);
+		size_t run = SERIALWRAP_RING_SIZE - index;
+		run = min(run, count);
+		run = min(run, (size_t)room);
+		run = min(run, maxBytes - written);
+		run = Serial.write((const uint8_t*)(_Ring + index), run);
+		if(run == 0)
+		{
+			break;
+		}
+		_Tail = tail + run;
+		written += run;
+	}
+	return written;
+}
+
+// get (and optionally clear) the count of lines lost to a full ring
+uint32_t SerialWrap::Dropped(bool doClear)
+{
+	uint32_t dropped = _Dropped;
+	if(doClear)
+	{
+		_Dropped = 0;
+	}
+	return dropped;
+}
+
+// in framed mode everything on the wire is a HostLink frame so the host
+// can demultiplex log text from binary packet records
+void SerialWrap::SetFramed(bool isFramed)
+{
+	_IsFramed = isFramed;
+}
+
+bool SerialWrap::isFramed()
+{
+	return _IsFramed;
+}
+
+// COBS encode a frame straight into the ring and queue it whole. Returns the bytes
+// queued (0 if dropped). The crc is worked out before interrupts are masked
+size_t SerialWrap::WriteFrame(uint8_t frameType, const uint8_t* body, size_t len)
+{
+	if(!_IsLogging && !_UseSerial)
+	{
+		return 0;
+	}
+	uint16_t crc = HostLink::FrameCrc(frameType, body, len);
+	size_t worst = len + 3 + (len + 3) / 254 + 2;
+	size_t queued;
+	{
+		IrqGuard guard;
+		size_t room = SERIALWRAP_RING_SIZE - Queued();
+		if(_IsLogging && worst > room)
+		{
+			_Tail += min(worst, (size_t)SERIALWRAP_RING_SIZE) - room;	// forget the oldest history
+			room = SERIALWRAP_RING_SIZE - Queued();
+		}
+		queued = HostLink::EncodeFrameToRing(frameType, body, len, crc, (uint8_t*)_Ring, SERIALWRAP_RING_SIZE, _Head, room);
+		if(queued == 0)
+		{
+			_Dropped++;
+			return 0;
+		}
+		_Head += queued;
+	}
+	if(!IrqGuard::InInterrupt())
+	{
+		Drain();
+	}
+	return queued;
+}
+
+// strcat that won't run off the end of a SERIALWRAP_LINE_MAX line
+size_t SerialWrap::AppendLine(char* line, size_t at, const char* text)
 {
+	while(*text && at < SERIALWRAP_LINE_MAX - 1)
+	{
+		line[at++] = *text++;
+	}
+	line[at] = 0;
+	return at;
+}
+
+// the "**caller@time" prefix println and printf put on every line
+size_t SerialWrap::StartLine(char* line)
+{
+	size_t len = 0;
+	line[0] = 0;
 	if(_IsLogging)
 	{
-		_SerialLog += "**" + _Caller + "@" + (*SerialWrap::_TimeFormatter)() + spout + "\r\n";
+		len = AppendLine(line, len, "**");
+	}
+	len = AppendLine(line, len, _Caller.c_str());
+	len = AppendLine(line, len, "@");
+	return len + (*SerialWrap::_TimeFormatter)(line + len, SERIALWRAP_LINE_MAX - len);
+}
+
+// frame or terminate the line and queue it
+size_t SerialWrap::EndLine(char* line, size_t len, bool newLine)
+{
+	if(_IsFramed && !_IsLogging)
+	{
+		return WriteFrame(HOSTLINK_TEXT, (const uint8_t*)line, len);
+	}
+	if(newLine)
+	{
+		len = min(len, (size_t)(SERIALWRAP_LINE_MAX - 2));	// always room for the line end
+		line[len++] = '\r';
+		line[len++] = '\n';
 	}
-	else if(_UseSerial && InitIfNeeded())
+	size_t queued = Enqueue(line, len);
+	if(!IrqGuard::InInterrupt())
+	{
+		Drain();
+	}
+	return queued;
+}
+
+// Serial mimic methods
+size_t SerialWrap::println(const char* spout)
+{
+	if(!_IsLogging && !_UseSerial)
 	{
-		return Serial.println(_Caller + "@" + (*SerialWrap::_TimeFormatter)() + spout);
+		return 0;
 	}
-	return 0;
+	char line[SERIALWRAP_LINE_MAX];
+	size_t len = StartLine(line);
+	len = AppendLine(line, len, spout);
+	return EndLine(line, len, true);
 }
 
 size_t SerialWrap::println(const String& sprint)
@@ -101,15 +310,14 @@ size_t SerialWrap::println(const String& sprint)
 
 size_t SerialWrap::print(const char* spout)
 {
-	if(_IsLogging)
+	if(!_IsLogging && !_UseSerial)
 	{
-		_SerialLog += (*SerialWrap::_TimeFormatter)() + String(spout);
+		return 0;
 	}
-	else if(_UseSerial && InitIfNeeded())
-	{
-		return Serial.print((*SerialWrap::_TimeFormatter)() + String(spout));
-	}
-	return 0;
+	char line[SERIALWRAP_LINE_MAX];
+	size_t len = (*SerialWrap::_TimeFormatter)(line, SERIALWRAP_LINE_MAX);
+	len = AppendLine(line, len, spout);
+	return EndLine(line, len, false);
 }
 
 size_t SerialWrap::println(int nout, int rng)
@@ -162,7 +370,7 @@ bool SerialWrap::InitIfNeeded(bool Force)
 	{
 		Serial.begin(_Baudrate);
 		_DidInit = true;
-		Serial.println("Starting up serial");
+		println("Starting up serial");	// queued, so it can't tear a binary frame
 	}
 
 	return this->available();
@@ -178,40 +386,128 @@ uint8_t SerialWrap::read()
 	return (Serial ? Serial.read() : 0);
 }
    
+// write an unsigned number into buffer at position at, zero padded to width digits
+// returns the new end. Stops (and null terminates) if the buffer is full
+static size_t AppendUint(char* buffer, size_t at, size_t size, uint32_t value, uint8_t width)
+{
+	char digits[10];
+	uint8_t count = 0;
+	do
+	{
+		digits[count++] = '0' + (value % 10);
+		value /= 10;
+	} while(value != 0);
+	while(count < width && count < sizeof(digits))
+	{
+		digits[count++] = '0';
+	}
+	while(count > 0 && at < size - 1)
+	{
+		buffer[at++] = digits[--count];
+	}
+	buffer[at] = 0;
+	return at;
+}
+
+static size_t AppendText(char* buffer, size_t at, size_t size, const char* text)
+{
+	while(*text && at < size - 1)
+	{
+		buffer[at++] = *text++;
+	}
+	buffer[at] = 0;
+	return at;
+}
+
+// have the default formatter show microseconds (h:m.s.mmmuuu) rather than milliseconds
+void SerialWrap::SetMicroTime(bool useMicros)
+{
+	_MicroTime = useMicros;
+}
+
+// micros() wraps every 71 minutes. millis() runs for 49 days and is never more than
+// a moment off, so it tells which lap micros() is on. No state, so no logging needed
+static uint64_t MicrosSinceStart()
+{
+	uint32_t now = micros();
+	uint64_t approx = (uint64_t)millis() * 1000;
+	uint64_t lap = (approx + 0x80000000UL - now) >> 32;	// nearest
+	return (lap << 32) | now;
+}
+
 // get time of day (millis) as hours:minutes.seconds.milliseconds
-String SerialWrap::getStrTime()
+// integer only and no heap so this is safe at any logging rate (or in an interrupt)
+size_t SerialWrap::FormatTime(char* buffer, size_t size)
 {
+	if(buffer == NULL || size == 0)
+	{
+		return 0;
+	}
 	// format into hours, minutes seconds
-	long nows = millis(); // time in millis
-	int onehour = 1000 * 60 * 60;
-	int onemin = 1000 * 60;
-	int hours = nows / onehour;
-	int minutes = (nows - hours * onehour) / onemin;
-	int mills = (nows - hours * onehour - minutes * onemin);
-	int seconds = mills / 1000;
-	mills = mills - seconds * 1000;
-	return String(hours) + ":" + String(minutes) + "." + String(seconds) + "." + String(mills) + "  ";
+	uint32_t nows;
+	uint32_t micro = 0;
+	if(_MicroTime)
+	{
+		// one micros() read for every field, or the digits can disagree at a rollover
+		uint64_t us = MicrosSinceStart();
+		nows = (uint32_t)(us / 1000);
+		micro = (uint32_t)(us % 1000);
+	}
+	else
+	{
+		nows = millis(); // time in millis
+	}
+	uint32_t mills = nows % 1000;
+	uint32_t seconds = (nows / 1000) % 60;
+	uint32_t minutes = (nows / 60000L) % 60;
+	uint32_t hours = nows / 3600000L;
+	size_t at = AppendUint(buffer, 0, size, hours, 1);
+	at = AppendText(buffer, at, size, ":");
+	at = AppendUint(buffer, at, size, minutes, 1);
+	at = AppendText(buffer, at, size, ".");
+	at = AppendUint(buffer, at, size, seconds, 1);
+	at = AppendText(buffer, at, size, ".");
+	if(_MicroTime)
+	{
+		at = AppendUint(buffer, at, size, mills, 3);
+		at = AppendUint(buffer, at, size, micro, 3);
+	}
+	else
+	{
+		at = AppendUint(buffer, at, size, mills, 1);
+	}
+	return AppendText(buffer, at, size, "  ");
+}
+
+// the default time stamp as a String, for app code that wants one
+String SerialWrap::getStrTime()
+{
+	char stamp[24];
+	FormatTime(stamp, sizeof(stamp));
+	return String(stamp);
 }
 
+// formatted straight after the prefix, so there's only the one line buffer
 size_t SerialWrap::printf(const char * format, ...)
 {
-	char buf[256];
+	if(!_IsLogging && !_UseSerial)
+	{
+		return 0;
+	}
+	char line[SERIALWRAP_LINE_MAX];
+	size_t at = StartLine(line);
 	int len;
 
 	va_list ap;
 	va_start(ap, format);
+	len = vsnprintf(line + at, SERIALWRAP_LINE_MAX - at, format, ap);	// this always null terminates
+	va_end(ap);
 
-	len = vsnprintf(buf, 254, format, ap);	// this will null terminate if len < 254
-	if(len == 254)
+	bool tooLong = len >= (int)(SERIALWRAP_LINE_MAX - at);
+	EndLine(line, tooLong ? SERIALWRAP_LINE_MAX - 1 : at + len, true);
+	if(tooLong)
 	{
-		Serial.print("printf String too long!");
-		buf[len] = 0;		// hard null terminate
-		buf[len+1] = 0;
-		len += 2;
+		println("printf String too long!");
 	}
-
-	println(buf);
-	
-	va_end(ap);
 	return len;
-}
\ No newline at end of file
+}
@@ -6,9 +6,33 @@
 // - actively reconnects when possible
 // - can log to a string instead of Serial
 // - prepends time (optional) to the output string
+// - never blocks: output is queued in a fixed ring buffer and drained to Serial
+//   from the loop, so it can be called from interrupt handlers
 
-// user-provided time formatter
-typedef String (*SerialTimeFormatter)();
+// the output ring size in bytes. Must be a power of two, and a gateway needs
+// HOSTLINK_MAX_FRAME for a whole forwarded packet
+#ifndef SERIALWRAP_RING_SIZE
+#if defined(__AVR__)
+#define SERIALWRAP_RING_SIZE 512
+#else
+#define SERIALWRAP_RING_SIZE 1024
+#endif
+#endif
+
+// the longest single line (prefix+time+text) that is queued. It's built on the stack,
+// possibly in an interrupt
+#ifndef SERIALWRAP_LINE_MAX
+#if defined(__AVR__)
+#define SERIALWRAP_LINE_MAX 128
+#else
+#define SERIALWRAP_LINE_MAX 256
+#endif
+#endif
+
+// user-provided time formatter. Writes a null terminated time stamp into buffer
+// (never more than size bytes including the null) and returns its length.
+// it is called for every line, possibly from an interrupt, so it must not allocate
+typedef size_t (*SerialTimeFormatter)(char* buffer, size_t size);
 
 class SerialWrap
 {
@@ -17,7 +41,9 @@ public:
 	void Start(int baud);
 	bool InitIfNeeded(bool Force=false);	// (re)initialize the port
 	void SetFormatter(SerialTimeFormatter timeFormatter);	// override the default formatter
-	static String getStrTime(void);			// the default time formatter
+	static size_t FormatTime(char* buffer, size_t size);	// the default time formatter
+	static String getStrTime(void);			// the default time stamp as a String
+	static void SetMicroTime(bool useMicros);	// default formatter shows microseconds
 	// Serial mimic stuff
 	size_t println(const String& sprint);
 	size_t println(const char* spout);
@@ -26,6 +52,13 @@ public:
 	size_t println(double dout, int rng = 2);
 	size_t println(unsigned int spout, int rng = DEC);
 	size_t printf(const char * format, ...);
+	// output queue
+	size_t Drain(size_t maxBytes = SERIALWRAP_RING_SIZE);	// move queued output to Serial without blocking. call from loop
+	uint32_t Dropped(bool doClear = false);	// how many lines were discarded because the ring was full
+	// binary host link (see HostLink.h)
+	void SetFramed(bool isFramed);	// when framed, text lines are sent as HOSTLINK_TEXT frames
+	bool isFramed();
+	size_t WriteFrame(uint8_t frameType, const uint8_t* body, size_t len);	// queue one COBS frame
 	
 	bool available();
 	uint8_t read();
@@ -34,12 +67,24 @@ public:
 	String setLogging(bool doLog);	// returns the log when doLog==false
 
 private:
+	size_t Enqueue(const char* data, size_t len);	// add one whole line to the ring
+	size_t Queued();								// bytes waiting in the ring
+	String History();								// the ring contents as a string
+	size_t AppendLine(char* line, size_t at, const char* text);	// bounded strcat
+	size_t StartLine(char* line);					// the caller@time prefix
+	size_t EndLine(char* line, size_t len, bool newLine);	// frame or terminate, and queue
+
 	bool _IsLogging;
-	String _SerialLog;
+	bool _IsFramed;
 	bool _DidInit;
 	String _Caller;
 	int _Baudrate;
 	SerialTimeFormatter _TimeFormatter;
+	// the ring. indices are free running and masked on use
+	char _Ring[SERIALWRAP_RING_SIZE];
+	volatile uint16_t _Head;	// next write
+	volatile uint16_t _Tail;	// next read
+	volatile uint32_t _Dropped;	// lines we could not fit
 };
 
 extern SerialWrap ASeries;
@@ -2,11 +2,12 @@
 #include <SPI.h>
 #include "SpiControl.h"
 #include "TinyVector.h"
+#include "SpiTrace.h"
 
 static const bool activeLowReset = true; // false for 1272, true for 1276
 
 // Constructor - set up the pins and SPI.
-SpiControl::SpiControl() : _Settings(400000, MSBFIRST, SPI_MODE0)
+SpiControl::SpiControl() : _Settings(400000, MSBFIRST, SPI_MODE0), _Trace(NULL)
 {
 }
 
@@ -18,7 +19,15 @@ void SpiControl::Initialize(int pinSS, int pinRST, int pinINT)
 
 	// set the GPIO pins appropriately
 	_DigInt.SetPin(pinINT); // establish IRQ as input
+#ifdef LORA_PIN_SS
+	_DigSS.Begin(1);
+#else
     _DigSS.SetPin(pinSS, 1); // SS is always active low
+#endif
+#if defined(LORA_PIN_RXEN) && defined(LORA_PIN_TXEN)
+	_DigTx.Begin(0);
+	_DigRx.Begin(1);
+#endif
 	_DigRst.SetPin(pinRST, activeLowReset ? 1 : 0);  // the reset (on high-low-high)
 }
 
@@ -28,22 +37,29 @@ void SpiControl::Initialize(int pinSS, int pinRST, int pinINT)
 // Setup Direction Pins. Current code calls this if detects an Sx1272
 void SpiControl::EnableDirPins(uint8_t rxPin, uint8_t txPin)
 {
+#if !(defined(LORA_PIN_RXEN) && defined(LORA_PIN_TXEN))		// else Initialize did it
     if(rxPin != NOPIN && txPin != NOPIN)
     {
 		_DigTx.SetPin(txPin, 0);
 		_DigRx.SetPin(rxPin, 1);
     }
+#endif
 }
 
 // Set direction pin values
 void SpiControl::SetSxDir(bool isReceive)
 {
+#if defined(LORA_PIN_RXEN) && defined(LORA_PIN_TXEN)
+	_DigTx = !isReceive;
+	_DigRx = isReceive;
+#else
 	// if SetupDirPins was never called, gracefully do nothing
 	if(_DigTx.IsInitialized())
 	{
 		_DigTx = !isReceive;
 		_DigRx = isReceive;
 }
+#endif
 }
 
 // sx127x transfer is always write two bytes while reading the second byte
@@ -59,6 +75,11 @@ uint8_t query[2];
 	SPI.transfer(query, 2);				// write register address
 	_DigSS = 1;
 	SPI.endTransaction();
+	if(_Trace)
+	{
+		// record the byte that matters: what we wrote or what we read
+		_Trace->Record(SPITRACE_XFER, address, (address & 0x80) ? &value : &query[1], 1);
+	}
 	return query[1];
 }
 
@@ -79,9 +100,29 @@ void SpiControl::Transfer( uint8_t address, uint8_t* buffer, uint8_t count)
 	tvData[0] = address;
 	memcpy(tvData+1, buffer, count);
 	SPI.transfer(tvData, count+1);
-	memcpy(buffer, tvData+1, count);
 	_DigSS = 1;
 	SPI.endTransaction();
+	if(_Trace)
+	{
+		// after the chip select so tracing doesn't stretch the transaction.
+		// buffer still holds what we sent, tvData now holds what came back
+		_Trace->Record(SPITRACE_XFER, address, (address & 0x80) ? buffer : tvData+1, count);
+	}
+	memcpy(buffer, tvData+1, count);
+}
+
+// optional recorder of every transaction. Costs one pointer test when off
+void SpiControl::SetTrace(SpiTrace* trace)
+{
+	_Trace = trace;
+}
+
+void SpiControl::TraceIrq(uint8_t dioLine)
+{
+	if(_Trace)
+	{
+		_Trace->Record(SPITRACE_IRQ, dioLine, NULL, 0);
+	}
 }
 
 // this doesn't belong here but it doesn't really belong anywhere, so put
@@ -91,6 +132,36 @@ int SpiControl::GetIrqPin()
 	return _DigInt.GetPin();
 }
 
+void SpiControl::SetDioPins(int dio1Pin, int dio3Pin)
+{
+	// these interrupts do spi too, so keep them out of our transactions
+	if(dio1Pin != NOPIN)
+	{
+		SPI.usingInterrupt(digitalPinToInterrupt(dio1Pin));
+		_DigDio1.SetPin(dio1Pin);
+	}
+	if(dio3Pin != NOPIN)
+	{
+		SPI.usingInterrupt(digitalPinToInterrupt(dio3Pin));
+		_DigDio3.SetPin(dio3Pin);
+	}
+}
+
+int SpiControl::GetDioPin(int dioLine)
+{
+	switch(dioLine)
+	{
+		case 0:
+			return _DigInt.GetPin();
+		case 1:
+			return _DigDio1.IsInitialized() ? _DigDio1.GetPin() : NOPIN;
+		case 3:
+			return _DigDio3.IsInitialized() ? _DigDio3.GetPin() : NOPIN;
+		default:
+			return NOPIN;
+	}
+}
+
 // this doesn't belong here but it doesn't really belong anywhere, so put
 // it with the other loraconfig-ed stuff
 void SpiControl::InitLoraPins()
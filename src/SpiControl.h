@@ -4,13 +4,17 @@
 #include <SPI.h>
 #include "DigitalIn.h"
 #include "DigitalOut.h"
+#include "FixedPin.h"
 
 class SPISettings;
+class SpiTrace;
 
 // SPI is inherently read/write. Write a byte always reads a byte, so...
 // These methods mimic that. Both transfer methods read or write to sx127x registers
 // so address = register address ( | 0x80 to write to the register)
 // and value is a byte, buffers is bytes
+// For fixed wiring, build with LORA_PIN_SS (and LORA_PIN_RXEN, LORA_PIN_TXEN) defined
+// to bind those pins at compile time. The pin numbers passed in are then ignored
 
 class SpiControl
 {
@@ -21,18 +25,34 @@ class SpiControl
 		uint8_t Transfer( uint8_t address, uint8_t value = 0);			// write a byte to address, return result
 		void Transfer( uint8_t address, uint8_t* buffer, uint8_t count);// write bytes to address, return values in buffer
 		int GetIrqPin(void);			// get the DIO0 (INT) pin number
+		void SetDioPins(int dio1Pin, int dio3Pin);	// the optional DIO1 and DIO3 lines (NOPIN if not wired)
+		int GetDioPin(int dioLine);		// NOPIN if that line isn't wired
 		void InitLoraPins(void);		// reset the Sx127x chip and set the pins up
 		void EnableDirPins(uint8_t rxPin, uint8_t txPin);	// use rx,tx enable pins
 		void SetSxDir(bool isReceive);
+		void SetTrace(SpiTrace* trace);		// record every transfer (NULL to stop)
+		void TraceIrq(uint8_t dioLine);		// note an interrupt in the trace
 
 	private :
 		DigitalIn _DigInt;
+		DigitalIn _DigDio1;
+		DigitalIn _DigDio3;
 		DigitalOut _DigRst;
+#ifdef LORA_PIN_SS
+		FixedOut<LORA_PIN_SS> _DigSS;
+#else
 		DigitalOut _DigSS;
+#endif
+#if defined(LORA_PIN_RXEN) && defined(LORA_PIN_TXEN)
+		FixedOut<LORA_PIN_RXEN> _DigRx;
+		FixedOut<LORA_PIN_TXEN> _DigTx;
+#else
 		DigitalOut _DigRx;
 		DigitalOut _DigTx;
+#endif
 		SPISettings _Settings;	// keep our SPI settings around
 		int _ModelNumber;		// 1276 or 1272
+		SpiTrace* _Trace;		// optional transaction recorder
 };
 
 #endif
@@ -0,0 +1,170 @@
+// --------------------------------------------------------------------
+// SpiTrace records SPI transactions into a fixed binary ring
+// Recording happens inside SpiControl::Transfer (loop and interrupt) so
+// it's one memcpy-sized loop with interrupts masked, nothing more.
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "SpiTrace.h"
+#include "IrqGuard.h"
+#include "HostLink.h"
+#include "SerialWrap.h"
+
+SpiTrace::SpiTrace(uint16_t size) : _Size(size), _Head(0), _Tail(0), _Used(0), _Enabled(true),
+	_Transactions(0), _Bytes(0), _Dropped(0)
+{
+	_Ring = (uint8_t*)malloc(size);
+	if(_Ring == NULL)
+	{
+		_Size = 0;
+	}
+}
+
+SpiTrace::~SpiTrace()
+{
+	if(_Ring)
+	{
+		free(_Ring);
+	}
+}
+
+void SpiTrace::Enable(bool isEnabled)
+{
+	_Enabled = isEnabled;
+}
+
+bool SpiTrace::IsEnabled()
+{
+	return _Enabled;
+}
+
+void SpiTrace::Put(uint8_t value)
+{
+	_Ring[_Head] = value;
+	_Head = (_Head + 1 == _Size) ? 0 : _Head + 1;
+	_Used++;
+}
+
+uint8_t SpiTrace::Peek(uint16_t offset)
+{
+	uint32_t at = (uint32_t)_Tail + offset;
+	return _Ring[(at >= _Size) ? at - _Size : at];
+}
+
+// throw away the oldest whole record
+void SpiTrace::DropOldest()
+{
+	uint16_t len = SPITRACE_HEADER + Peek(2);
+	uint32_t at = (uint32_t)_Tail + len;
+	_Tail = (at >= _Size) ? at - _Size : at;
+	_Used -= len;
+	_Dropped++;
+}
+
+void SpiTrace::Record(uint8_t kind, uint8_t address, const uint8_t* data, uint8_t count)
+{
+	if(kind == SPITRACE_XFER)
+	{
+		_Transactions++;
+		_Bytes += count;
+	}
+	uint16_t len = SPITRACE_HEADER + count;
+	if(!_Enabled || len > _Size)
+	{
+		return;
+	}
+	uint32_t now = micros();
+	IrqGuard guard;
+	while(_Size - _Used < len)
+	{
+		DropOldest();
+	}
+	Put(kind);
+	Put(address);
+	Put(count);
+	Put(now & 0xff);
+	Put((now >> 8) & 0xff);
+	Put((now >> 16) & 0xff);
+	Put(now >> 24);
+	for(uint8_t i = 0; i < count; i++)
+	{
+		Put(data[i]);
+	}
+}
+
+void SpiTrace::Clear()
+{
+	IrqGuard guard;
+	_Head = 0;
+	_Tail = 0;
+	_Used = 0;
+}
+
+size_t SpiTrace::Used()
+{
+	return _Used;
+}
+
+// copy out as many whole records as fit, removing them from the ring
+size_t SpiTrace::Read(uint8_t* out, size_t size)
+{
+	size_t at = 0;
+	while(true)
+	{
+		IrqGuard guard;
+		if(_Used == 0)
+		{
+			break;
+		}
+		uint16_t len = SPITRACE_HEADER + Peek(2);
+		if(at + len > size)
+		{
+			break;
+		}
+		for(uint16_t i = 0; i < len; i++)
+		{
+			out[at++] = Peek(i);
+		}
+		uint32_t tail = (uint32_t)_Tail + len;
+		_Tail = (tail >= _Size) ? tail - _Size : tail;
+		_Used -= len;
+	}
+	return at;
+}
+
+// frames are whole records so the host just concatenates the bodies
+void SpiTrace::DumpToHost()
+{
+	uint8_t body[HOSTLINK_MAX_BODY];
+	size_t len;
+	while((len = Read(body, sizeof(body))) > 0)
+	{
+		int tries = 100;
+		while(ASeries.WriteFrame(HOSTLINK_SPITRACE, body, len) == 0 && --tries > 0)
+		{
+			ASeries.Drain();	// output ring full, give Serial a moment to catch up (loop only)
+			delay(1);
+		}
+	}
+}
+
+uint32_t SpiTrace::Transactions()
+{
+	return _Transactions;
+}
+
+uint32_t SpiTrace::BytesMoved()
+{
+	return _Bytes;
+}
+
+uint32_t SpiTrace::Dropped()
+{
+	return _Dropped;
+}
+
+void SpiTrace::ResetCounts()
+{
+	_Transactions = 0;
+	_Bytes = 0;
+	_Dropped = 0;
+}
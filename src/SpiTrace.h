@@ -0,0 +1,58 @@
+#ifndef SPI_TRACE_H
+#define SPI_TRACE_H
+
+// A compact binary recorder of every SpiControl transaction (and every radio
+// interrupt) for offline analysis and for the deterministic replay harness in
+// extras/host/replay.
+// The trace is a byte ring of variable length records, oldest dropped first:
+//   kind(u8) address(u8) count(u8) micros(u32 little endian) data[count]
+// for SPITRACE_XFER the address is the sx127x register with bit 7 set for a write
+// and data is what was written (write) or what came back (read).
+// for SPITRACE_IRQ the address is the DIO line that fired and count is 0.
+// |	static SpiTrace trace(4096);
+// |	lru.SetSpiTrace(&trace);		// before Initialize to capture the init sequence
+// |	trace.ResetCounts(); lru.SendString("x"); ... trace.Transactions() ...
+// |	trace.DumpToHost();				// ship it over the HostLink
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPITRACE_XFER 0x01
+#define SPITRACE_IRQ 0x02
+#define SPITRACE_HEADER 7
+
+class SpiTrace
+{
+	public:
+		SpiTrace(uint16_t size = 2048);
+		virtual ~SpiTrace();
+		void Enable(bool isEnabled);		// pause/resume recording (counts still run)
+		bool IsEnabled();
+		void Record(uint8_t kind, uint8_t address, const uint8_t* data, uint8_t count);
+		void Clear();						// empty the ring
+		size_t Used();						// bytes of records in the ring
+		size_t Read(uint8_t* out, size_t size);	// move whole records out of the ring, oldest first
+		void DumpToHost();					// empty the ring as HOSTLINK_SPITRACE frames
+		// statistics
+		uint32_t Transactions();			// transfers seen since ResetCounts
+		uint32_t BytesMoved();				// payload bytes of those transfers
+		uint32_t Dropped();					// records lost to a full ring
+		void ResetCounts();
+
+	private:
+		void Put(uint8_t value);
+		uint8_t Peek(uint16_t offset);
+		void DropOldest();
+
+		uint8_t* _Ring;
+		uint16_t _Size;
+		volatile uint16_t _Head;	// next write offset
+		volatile uint16_t _Tail;	// oldest record
+		volatile uint16_t _Used;
+		bool _Enabled;
+		volatile uint32_t _Transactions;
+		volatile uint32_t _Bytes;
+		volatile uint32_t _Dropped;
+};
+
+#endif // SPI_TRACE_H
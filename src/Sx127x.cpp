@@ -16,6 +16,8 @@ There's an exact copy in Micropython at ??
 #include "SpiControl.h"
 #include "TinyVector.h"
 #include "SerialWrap.h"
+#include "LoraLog.h"
+#include "IrqGuard.h"
 
 #define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
 
@@ -32,7 +34,7 @@ int REG_FIFO_ADDR_PTR = 0x0d;
 
 int REG_FIFO_TX_BASE_ADDR = 0x0e;
 int FifoTxBaseAddr = 0x00;
-// FifoTxBaseAddr = 0x80;
+int FifoTxStageAddr = 0x80;		// the top half with enableStaging
 
 int REG_FIFO_RX_BASE_ADDR = 0x0f;
 int FifoRxBaseAddr = 0x00;
@@ -40,15 +42,21 @@ int REG_FIFO_RX_CURRENT_ADDR = 0x10;
 int REG_IRQ_FLAGS_MASK = 0x11;
 int REG_IRQ_FLAGS = 0x12;
 int REG_RX_NB_BYTES = 0x13;
+int REG_MODEM_STAT = 0x18;		// bit 0 is signal detected
+int REG_SYMB_TIMEOUT_LSB = 0x1f;	// the msb bits are the bottom of REG_MODEM_CONFIG_2
+int REG_HOP_CHANNEL = 0x1c;
+int REG_PKT_SNR_VALUE = 0x19;
 int REG_PKT_RSSI_VALUE = 0x1a;
-int REG_PKT_SNR_VALUE = 0x1b;
+int REG_RSSI_VALUE = 0x1b;		// current rssi
 int REG_MODEM_CONFIG_1 = 0x1d;
 int REG_MODEM_CONFIG_2 = 0x1e;
 int REG_PREAMBLE_MSB = 0x20;
 int REG_PREAMBLE_LSB = 0x21;
 int REG_PAYLOAD_LENGTH = 0x22;
+int REG_HOP_PERIOD = 0x24;
 int REG_FIFO_RX_BYTE_ADDR = 0x25;
 int REG_MODEM_CONFIG_3 = 0x26;
+int REG_FEI_MSB = 0x28;		// frequency error, 20 bits signed across 0x28..0x2a
 int REG_RSSI_WIDEBAND = 0x2c;
 int REG_DETECTION_OPTIMIZE = 0x31;
 int REG_DETECTION_THRESHOLD = 0x37;
@@ -69,6 +77,7 @@ int MODE_RX_CONTINUOUS = 0x05;
 // MODE_RX_SINGLE = 0x06
 // 6 is not supported on the 1276
 int MODE_RX_SINGLE = 0x06;
+int MODE_CAD = 0x07;
  
 // fsk modes for calibration setting
 int MODE_SYNTHESIZER_TX = 0x02;
@@ -90,12 +99,25 @@ int IMAGECAL_TEMPMONITOR_OFF = 0x01;
 
 // PA config
 int PA_BOOST = 0x80;
+int OCP_ON = 0x20;		// REG_OCP enable bit, the trim is in the low 5 bits
  
 // IRQ masks
 int IRQ_TX_DONE_MASK = 0x08;
 int IRQ_PAYLOAD_CRC_ERROR_MASK = 0x20;
 int IRQ_RX_DONE_MASK = 0x40;
 int IRQ_RX_TIME_OUT_MASK = 0x80;
+int IRQ_CAD_DETECTED_MASK = 0x01;
+int IRQ_FHSS_CHANGE_MASK = 0x02;
+int IRQ_CAD_DONE_MASK = 0x04;
+int IRQ_VALID_HEADER_MASK = 0x10;
+
+// REG_DIO_MAPPING_1 fields: dio0 bits 7-6, dio1 bits 5-4, dio3 bits 1-0
+int DIO0_RX_DONE = 0x00;
+int DIO0_TX_DONE = 0x40;
+int DIO0_CAD_DONE = 0x80;
+int DIO1_RX_TIMEOUT = 0x00;
+int DIO1_FHSS_CHANGE = 0x10;
+int DIO3_VALID_HEADER = 0x01;
  
 // Buffer size
 int MAX_PKT_LENGTH = 255;
@@ -159,8 +181,30 @@ static const bool _ActiveLowIrq = false;
 	}
 
 	/// Standard SX127x library. Requires an spicontrol.SpiControl instance for spiControl
-	Sx127x::Sx127x() : _FifoBuf(NULL), _SpiControl(NULL), _LoraRcv(NULL), _LastSentTime(0), _LastReceivedTime(0), _IrqFunction(nullptr), _IrqPin(-1)
+	Sx127x::Sx127x() : _FifoBuf(NULL), _SpiControl(NULL), _LoraRcv(NULL), _LastSentTime(0), _LastReceivedTime(0), _IrqPin(-1)
 	{
+		memset(&_LastPacketInfo, 0, sizeof(_LastPacketInfo));
+		_PaCacheValid = false;
+		_TxPower = 0;
+		_PaOutputPin = PA_OUTPUT_PA_BOOST_PIN;
+		_SpreadingFactor = 7;
+		_SignalBandwidth = 125000;
+		_CodingRate = 5;
+		_PreambleLength = 8;
+		_CrcEnabled = false;
+		_ImplicitHeaderMode = false;
+		_FilterBytes = 0;
+		_HopPeriod = 0;
+		_FifoTxBase = FifoTxBaseAddr;
+		_FifoWriteBase = FifoTxBaseAddr;
+		_StagedLength = 0;
+		_StagedImplicit = false;
+		_Callbacks.receive = NULL;
+		_Callbacks.transmit = NULL;
+		_Callbacks.acceptHeader = NULL;
+		_CallbackContext = NULL;
+		_IrqMode = SXIRQ_NONE;
+		_RxWindow = false;
 
 	}
 
@@ -173,12 +217,14 @@ static const bool _ActiveLowIrq = false;
 		this->_FifoBuf = new TinyVector(0, 30);	// our sorta persistent buffer
 		this->_LastSentTime = 0;
 		this->_LastReceivedTime = 0;
+		this->_LastSentMicros = 0;
+		this->_LastReceivedMicros = 0;
 		_Singleton = this;				// yuck... but required for interrupt handler
 		this->PrepIrqHandler(Sx127x::HandleInterrupt);		// call this once to set the interrupt handler
-		ASeries.println("Finish Sx127x construction.");
+		LORA_DEBUG("Finish Sx127x construction.");
 		if(Is1272())
 		{
-			ASeries.printf("Setting up direction pins with %d . %d", rxPin, txPin);
+			LORA_DEBUG("Setting up direction pins with %d . %d", rxPin, txPin);
 			this->_SpiControl->EnableDirPins(rxPin, txPin);    // use the rxenable and txenable pins
 	}
 	}
@@ -203,7 +249,7 @@ static const bool _ActiveLowIrq = false;
 	bool Sx127x::init(const StringPair* params)
 	{
 		// check version
-		ASeries.println("Reading version");
+		LORA_DEBUG("Reading version");
 		int version = this->readRegister(REG_VERSION);
 		if(version == REQUIRED_VERSION)
 		{
@@ -215,14 +261,15 @@ static const bool _ActiveLowIrq = false;
 		}
 		else
 		{
-			ASeries.printf("Detected incorrect version: %d", version);
+			LORA_ERROR("Detected incorrect version: %d", version);
 			return false;
 		}
-		ASeries.printf("Read version %d ok", _ModelNumber);
+		LORA_INFO("Read version %d ok", _ModelNumber);
 
 		// put in LoRa and sleep mode
+		_PaCacheValid = false;		// we may have just been reset
 		this->sleep();
-		ASeries.println("Sleeping");
+		LORA_TRACE("Sleeping");
 
 		// config set frequency offset before setting frequency
 		double freqOff = UseParam(params, "freq_offset");
@@ -245,7 +292,7 @@ static const bool _ActiveLowIrq = false;
 		int powerpin = UseParam(params, "power_pin");	// powerpin = PA_OUTPUT_PA_BOOST_PIN or PA_OUTPUT_RFO_PIN
 		if(powerpin != PA_OUTPUT_PA_BOOST_PIN && powerpin != PA_OUTPUT_RFO_PIN)
 		{
-			ASeries.printf("Invalid power_pin setting. Must be 0 or 1. It is = %d", powerpin);
+			LORA_WARN("Invalid power_pin setting. Must be 0 or 1. It is = %d", powerpin);
 			powerpin = PA_OUTPUT_PA_BOOST_PIN; // ?
 		}
 		this->setTxPower(UseParam(params, "tx_power_level"), powerpin);
@@ -258,11 +305,14 @@ static const bool _ActiveLowIrq = false;
 		this->enableCRC(UseParam(params, "enable_CRC"));
 
 		// set base addresses
-		this->writeRegister(REG_FIFO_TX_BASE_ADDR, FifoTxBaseAddr);
+		this->_FifoTxBase = FifoTxBaseAddr;
+		this->_FifoWriteBase = FifoTxBaseAddr;
+		this->_StagedLength = 0;
+		this->writeRegister(REG_FIFO_TX_BASE_ADDR, this->_FifoTxBase);
 		this->writeRegister(REG_FIFO_RX_BASE_ADDR, FifoRxBaseAddr);
 
 		this->standby();
-		ASeries.println("Finish sx127x initialization.");
+		LORA_INFO("Finish sx127x initialization.");
 		return true;
 	}
 
@@ -278,14 +328,21 @@ static const bool _ActiveLowIrq = false;
 	}
 
 	// start sending a packet (reset the fifo address, go into standby)
+	// it takes the whole fifo, staging or not, so any staged packet is lost
 	void Sx127x::beginPacket(bool implicitHeaderMode)
 	{
 		_SpiControl->SetSxDir(false);	// turn on transmit rf chain
-		_IrqFunction = nullptr;	// this isn't necessary but if things go wrong it helps with debug
+		_IrqMode = SXIRQ_NONE;	// this isn't necessary but if things go wrong it helps with debug
 		this->standby();
+		this->_StagedLength = 0;		// about to be overwritten
 		this->implicitHeaderMode(implicitHeaderMode);
+		if(this->_FifoTxBase != FifoTxBaseAddr)
+		{
+			this->writeRegister(REG_FIFO_TX_BASE_ADDR, FifoTxBaseAddr);		// beginStage puts it back
+		}
+		this->_FifoWriteBase = FifoTxBaseAddr;
 		// reset FIFO address and paload length
-		this->writeRegister(REG_FIFO_ADDR_PTR, FifoTxBaseAddr);
+		this->writeRegister(REG_FIFO_ADDR_PTR, this->_FifoWriteBase);
 		this->writeRegister(REG_PAYLOAD_LENGTH, 0);
 	}
 
@@ -295,15 +352,15 @@ static const bool _ActiveLowIrq = false;
 	void Sx127x::endPacket() 
 	{
 		// non-blocking end packet
-		if (this->_LoraRcv)
+		if (this->HasHandler())
 		{
 		   // enable tx to raise DIO0
-			_IrqFunction = &Sx127x::TransmitSub;
-			this->writeRegister(REG_DIO_MAPPING_1, 0x40);		   // enable transmit dio0
+			_IrqMode = SXIRQ_TRANSMIT;
+			this->writeRegister(REG_DIO_MAPPING_1, DioMapping(DIO0_TX_DONE));		   // enable transmit dio0
 		}
 		else
 		{
-			_IrqFunction = nullptr;
+			_IrqMode = SXIRQ_NONE;
 		}
 		// put in TX mode
 		this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
@@ -314,9 +371,9 @@ static const bool _ActiveLowIrq = false;
 	bool Sx127x::isTxDone() 
 	{
 		// if Tx is done return true, and clear irq register - so it only returns true once 
-		if(this->_LoraRcv)
+		if(this->HasHandler())
 		{
-			ASeries.println("Do not call isTxDone with transmit interrupts enabled. Use the callback.");
+			LORA_WARN("Do not call isTxDone with transmit interrupts enabled. Use the callback.");
 			return false;
 		}
 		int irqFlags = this->getIrqFlags();
@@ -332,7 +389,7 @@ static const bool _ActiveLowIrq = false;
 	{
 		uint8_t currentLength = this->readRegister(REG_PAYLOAD_LENGTH);
 		// check size
-		size = min(size, (MAX_PKT_LENGTH - FifoTxBaseAddr - currentLength));
+		size = min(size, (MAX_PKT_LENGTH - this->_FifoWriteBase - currentLength));
 		if(size == 1)
 		{
 			uint8_t value = *buffer;
@@ -394,38 +451,71 @@ static const bool _ActiveLowIrq = false;
 		return this->_LastSentTime;
 	}
 
-	// this returns real (not packet) rssi
+	uint32_t Sx127x::getLastReceivedMicros(void)
+	{
+		return this->_LastReceivedMicros;
+	}
+
+	uint32_t Sx127x::getLastSentMicros(void)
+	{
+		return this->_LastSentMicros;
+	}
+
+	// this returns real (not packet) rssi of the last packet read
 	int Sx127x::packetRssi() 
 	{
-		int rssi = this->readRegister(REG_PKT_RSSI_VALUE);
-		// Adjust the RSSI, datasheet page 87. This maximizes accuracy
-		float snr = packetSnr();
-		if(this->_Frequency < 868)
-		{	// 433MHz
-			rssi = rssi - 164;
-			if(snr < 0)
-			{
-				rssi += snr;		// decrease it
-			}
-		}
-		else
-		{	// 868,915MHz
-			if(snr < 0)
-			{
-				rssi = rssi + snr - 157;
-			}
-			else
-			{
-				rssi = (int)(rssi * 16 / 15) - 157;
-			}
-		}
-		return rssi;
+		return _LastPacketInfo.rssi;
 	}
 
 	// real SNR
 	float Sx127x::packetSnr() 
 	{
-		return ((int8_t)this->readRegister(REG_PKT_SNR_VALUE)) * 0.25;	// signed result
+		return _LastPacketInfo.snrQuarter * 0.25;
+	}
+
+	int32_t Sx127x::packetFrequencyError()
+	{
+		return _LastPacketInfo.freqError;
+	}
+
+	const LoraPacketInfo& Sx127x::lastPacketInfo()
+	{
+		return _LastPacketInfo;
+	}
+
+	// pktRegs is the REG_PKT_SNR_VALUE...REG_RSSI_VALUE burst
+	// Adjust the RSSI, datasheet page 87. This maximizes accuracy
+	void Sx127x::CapturePacketInfo(const uint8_t* pktRegs)
+	{
+		int8_t snr4 = (int8_t)pktRegs[0];	// signed, quarter dB
+		int rssi = pktRegs[1];
+		int current = pktRegs[2];
+		int offset = Is1272() ? 139 : ((_Frequency < 779E6) ? 164 : 157);	// LF port (433MHz) or HF (868,915MHz)
+		if(snr4 < 0)
+		{
+			rssi = rssi + snr4 / 4 - offset;		// decrease it
+		}
+		else if(offset == 157)
+		{
+			rssi = (rssi * 16) / 15 - offset;
+		}
+		else
+		{
+			rssi = rssi - offset;
+		}
+		_LastPacketInfo.snrQuarter = snr4;
+		_LastPacketInfo.rssi = rssi;
+		_LastPacketInfo.currentRssi = current - offset;
+
+		// frequency error: FreqError * 2**24 / Fxtal * BW / 500kHz = FreqError * BW * 8192 / 7812500000
+		uint8_t fei[3];
+		readRegisters(REG_FEI_MSB, fei, 3);
+		int32_t raw = ((int32_t)(fei[0] & 0x0f) << 16) | ((int32_t)fei[1] << 8) | fei[2];
+		if(raw & 0x80000)
+		{
+			raw -= 0x100000;		// sign extend 20 bits
+		}
+		_LastPacketInfo.freqError = (int32_t)(((int64_t)raw * _SignalBandwidth * 8192) / 7812500000LL);
 	}
 
 	// go into standby mode. preparatory to sending usually
@@ -437,6 +527,7 @@ static const bool _ActiveLowIrq = false;
 	// sleep the chip. it auto-wakes up but more slowly than if wide awake
 	void Sx127x::sleep() 
 	{
+		this->_StagedLength = 0;		// the fifo doesn't survive sleep
 		this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
 	}
 
@@ -448,9 +539,19 @@ static const bool _ActiveLowIrq = false;
 	// **RFOP = +17 dBm, on PA_BOOST -- 87mA
 	// RFOP = +13 dBm, on RFO_LF/HF pin -- 29mA
 	// RFOP = + 7 dBm, on RFO_LF/HF pin	-- 20mA
+	// the pa registers are cached so a power change (per packet with tpc) only writes
+	// what moved: usually just REG_PA_CONFIG, plus PA_DAC and OCP across 17 dBm
 	void Sx127x::setTxPower(int level, int outputPin)
 	{
-		ASeries.printf("Set transmit power to: %d at pin: %d", level, outputPin);
+		LORA_DEBUG("Set transmit power to: %d at pin: %d", level, outputPin);
+		if(!_PaCacheValid)
+		{
+			_PaConfig = readRegister(REG_PA_CONFIG);
+			_PaDac = readRegister(REG_PA_DAC);
+			_Ocp = readRegister(REG_OCP);
+			_PaCacheValid = true;
+		}
+		_PaOutputPin = outputPin;
 
 		// I think the boosted system is power-limited by default
 		// so if boosted, bump the power max in the RegPaDac
@@ -458,27 +559,22 @@ static const bool _ActiveLowIrq = false;
 		{
 			if(level > 17)
 			{
-				uint8_t dacSet = readRegister(REG_PA_DAC);	// retain existing upper bits
-				uint8_t newDac = dacSet | 7;				// allow pa up to 20dBm
-				ASeries.printf("Set PaDac value from %d to %d", (int)dacSet, (int)newDac);
-				writeRegister(REG_PA_DAC, newDac);
+				// allow pa up to 20dBm, retain existing upper bits
+				LORA_TRACE("Set PaDac value to allow 20 dBm");
+				WriteCached(REG_PA_DAC, _PaDac, _PaDac | 7);
 
 				// increase overcurrent max - requires short duty cycle
-				uint8_t newOcp = 0x20 + 18;		// 150mA [-30 + 10*value]
-				ASeries.printf("Increasing allowed current to 150mA");
-				writeRegister(REG_OCP, newOcp);
+				LORA_TRACE("Increasing allowed current to 150mA");
+				WriteCached(REG_OCP, _Ocp, OCP_ON | 18);		// 150mA [-30 + 10*value]
 			}
 			else
 			{
-				uint8_t dacSet = readRegister(REG_PA_DAC);	// retain existing upper bits
-				uint8_t newDac = (dacSet & ~7) | 4;			// do not allow 20dBm
-				ASeries.printf("Set Dac value from %d to %d", (int)dacSet, (int)newDac);
-				writeRegister(REG_PA_DAC, newDac);
+				LORA_TRACE("Set Dac value to not allow 20 dBm");
+				WriteCached(REG_PA_DAC, _PaDac, (_PaDac & ~7) | 4);
 
 				// set default overcurrent max
-				uint8_t newOcp = 11;		// 100mA [45 + 5*value]
-				ASeries.printf("Setting allowed current to 100mA");
-				writeRegister(REG_OCP, newOcp);
+				LORA_TRACE("Setting allowed current to 100mA");
+				WriteCached(REG_OCP, _Ocp, OCP_ON | 11);		// 100mA [45 + 5*value]
 			}
 		}
 
@@ -493,7 +589,8 @@ static const bool _ActiveLowIrq = false;
 			{
 				level = 14;
 			}
-			this->writeRegister(REG_PA_CONFIG, 0x70 | level);	// set Pmax=15dBm and Pout=PaConfig[0:4]=level
+			_TxPower = level;
+			WriteCached(REG_PA_CONFIG, _PaConfig, 0x70 | level);	// set Pmax=15dBm and Pout=PaConfig[0:4]=level
 		}
 		else
 		{
@@ -506,6 +603,7 @@ static const bool _ActiveLowIrq = false;
 			{
 				level = 20;
 			}
+			_TxPower = level;
 			// normalize to 0...15
 			if( level > 17)
 			{
@@ -515,7 +613,16 @@ static const bool _ActiveLowIrq = false;
 			{
 				level = level - 2;		// <= 17 and Pout=2+PaConfig[0:4] (dBm)
 			}
-			this->writeRegister(REG_PA_CONFIG, PA_BOOST | level);	// per spec the 0x70 bits are ignored in boost mode
+			WriteCached(REG_PA_CONFIG, _PaConfig, PA_BOOST | level);	// per spec the 0x70 bits are ignored in boost mode
+		}
+	}
+
+	void Sx127x::WriteCached(uint8_t address, uint8_t& cached, uint8_t value)
+	{
+		if(cached != value)
+		{
+			cached = value;
+			writeRegister(address, value);
 		}
 	}
 
@@ -524,14 +631,14 @@ static const bool _ActiveLowIrq = false;
 	// FSTEP = FXOSC/2**19 where FXOSC=32MHz. So FSTEP==61.03515625
 	void Sx127x::setFrequency(double frequency)
 	{
-		ASeries.printf("Set frequency to: %12g with offset %g", frequency, _FrequencyOffset);
+		LORA_DEBUG("Set frequency to: %12g with offset %g", frequency, _FrequencyOffset);
 		this->_Frequency = frequency;
 		uint32_t stepf = (uint32_t)((frequency+_FrequencyOffset) / 61.03515625);	// get 24 bits of freq/step
 		uint8_t frfs[3];
 		frfs[0] = 0xff & (stepf>>16);
 		frfs[1] = 0xff & (stepf>>8);
 		frfs[2] = 0xff & (stepf);
-		ASeries.printf("Frf registers: %d.%d.%d", (int)frfs[0], (int)frfs[1], (int)frfs[2]);
+		LORA_TRACE("Frf registers: %d.%d.%d", (int)frfs[0], (int)frfs[1], (int)frfs[2]);
 		this->writeRegister(REG_FRF_MSB, frfs[0]);
 		this->writeRegister(REG_FRF_MID, frfs[1]);
 		this->writeRegister(REG_FRF_LSB, frfs[2]);
@@ -542,7 +649,7 @@ static const bool _ActiveLowIrq = false;
 	// (optional)
 	void Sx127x::setFrequencyOffset(double offset)
 	{
-		ASeries.printf("Set frequency offset to: %g", offset);
+		LORA_DEBUG("Set frequency offset to: %g", offset);
 		_FrequencyOffset = offset;
 		if(_Frequency != 0)
 		{
@@ -552,7 +659,7 @@ static const bool _ActiveLowIrq = false;
 
 	void Sx127x::setSpreadingFactor(int sf)
 	{
-		ASeries.printf("Set spreading factor to: %d", sf);
+		LORA_DEBUG("Set spreading factor to: %d", sf);
 		sf = min(max(sf, 6), 12);
 		_SpreadingFactor = sf;
 		this->writeRegister(REG_DETECTION_OPTIMIZE, (sf == 6) ? 0xc5 : 0xc3);
@@ -563,7 +670,7 @@ static const bool _ActiveLowIrq = false;
 
 	void Sx127x::setSignalBandwidth(int sbw)
 	{
-		ASeries.printf("Set sbw to: %d", sbw);
+		LORA_DEBUG("Set sbw to: %d", sbw);
 		int bins[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
 		int bw = 9;		// default to 500K
 		for (int i=0; i<ARRAY_SIZE(bins); i++)
@@ -581,7 +688,7 @@ static const bool _ActiveLowIrq = false;
 			if(bw < 7)
 			{
 				bw = 7;
-				ASeries.printf("Unable to set low data rate of %d for Sx1272", sbw);
+				LORA_WARN("Unable to set low data rate of %d for Sx1272", sbw);
 			}
 			bw -= 7;
 			writeRegister(REG_MODEM_CONFIG_1, (this->readRegister(REG_MODEM_CONFIG_1) & 0x3f) | (bw << 6));
@@ -593,9 +700,10 @@ static const bool _ActiveLowIrq = false;
 
 	void Sx127x::setCodingRate(int denominator)
 	{
-		ASeries.printf("Set coding rate to: %d", denominator);
+		LORA_DEBUG("Set coding rate to: %d", denominator);
 		// this takes a value of 5..8 as the denominator of 4/5, 4/6, 4/7, 5/8
 		denominator = min(max(denominator, 5), 8);
+		_CodingRate = denominator;
 		int cr = denominator - 4;
 		if(Is1272())
 		{
@@ -609,14 +717,16 @@ static const bool _ActiveLowIrq = false;
 
 	void Sx127x::setPreambleLength(int length)
 	{
-		ASeries.printf("Set preamble length to: %d", length);
+		LORA_DEBUG("Set preamble length to: %d", length);
+		_PreambleLength = length;
 		this->writeRegister(REG_PREAMBLE_MSB, (length >> 8) & 0xff);
 		this->writeRegister(REG_PREAMBLE_LSB, (length >> 0) & 0xff);
 	}
 
 	void Sx127x::enableCRC(bool enable_CRC)
 	{
-		ASeries.printf("Enable crc: %s", enable_CRC ? "Yes" : "No");
+		LORA_DEBUG("Enable crc: %s", enable_CRC ? "Yes" : "No");
+		_CrcEnabled = enable_CRC;
 		uint8_t modem_config_2 = this->readRegister(REG_MODEM_CONFIG_2);
 		uint8_t config = 0;
 		if(Is1272())
@@ -635,7 +745,7 @@ static const bool _ActiveLowIrq = false;
 	{
 		if (this->_ImplicitHeaderMode != implicitHeaderMode)  // set value only if different.
 		{
-			ASeries.printf("Set implicit header: %s", implicitHeaderMode ? "Yes" : "No");
+			LORA_DEBUG("Set implicit header: %s", implicitHeaderMode ? "Yes" : "No");
 			this->_ImplicitHeaderMode = implicitHeaderMode;
 			uint8_t modem_config_1 = readRegister(REG_MODEM_CONFIG_1);
 			uint8_t config = 0;
@@ -663,13 +773,148 @@ static const bool _ActiveLowIrq = false;
 		}
 	}
 
+	// split the fifo: received packets go in the bottom half and staged ones (127 bytes
+	// at most) in the top half, so the next packet can be loaded ahead of time with
+	// beginStage/endStage and sent later with just a few register writes. beginPacket
+	// still gets the whole fifo
+	void Sx127x::enableStaging(bool enable)
+	{
+		this->standby();
+		this->_StagedLength = 0;
+		this->_FifoTxBase = enable ? FifoTxStageAddr : FifoTxBaseAddr;
+		this->writeRegister(REG_FIFO_TX_BASE_ADDR, this->_FifoTxBase);
+	}
+
+	// like beginPacket, then fill it with writeFifo. The fifo can only be written in standby
+	void Sx127x::beginStage(bool implicitHeaderMode)
+	{
+		this->standby();
+		this->_StagedLength = 0;
+		this->_StagedImplicit = implicitHeaderMode;
+		this->_FifoWriteBase = this->_FifoTxBase;
+		this->writeRegister(REG_FIFO_TX_BASE_ADDR, this->_FifoTxBase);	// beginPacket may have moved it
+		this->writeRegister(REG_FIFO_ADDR_PTR, this->_FifoTxBase);
+		this->writeRegister(REG_PAYLOAD_LENGTH, 0);
+	}
+
+	// instead of endPacket. The chip stays in standby, receive() can follow
+	void Sx127x::endStage()
+	{
+		this->_StagedLength = this->readRegister(REG_PAYLOAD_LENGTH);
+	}
+
+	bool Sx127x::sendStaged()
+	{
+		uint8_t length = this->_StagedLength;
+		if(length == 0)
+		{
+			return false;
+		}
+		_SpiControl->SetSxDir(false);	// turn on transmit rf chain
+		this->standby();
+		this->_StagedLength = 0;
+		this->implicitHeaderMode(this->_StagedImplicit);
+		this->writeRegister(REG_FIFO_ADDR_PTR, this->_FifoTxBase);
+		this->writeRegister(REG_PAYLOAD_LENGTH, length);
+		this->endPacket();
+		return true;
+	}
+
 	void Sx127x::setReceiver(LoraReceiver* receiver)
 	{
 		this->_LoraRcv = receiver;
 	}
 
+	// the same as the receiver's _doReceive, _doTransmit and _acceptHeader but called
+	// through plain function pointers, and the packet comes with its metadata. Any left
+	// NULL still go to the receiver. NULL callbacks clears them all
+	void Sx127x::setCallbacks(const LoraCallbacks* callbacks, void* context)
+	{
+		IrqGuard guard;
+		if(callbacks)
+		{
+			this->_Callbacks = *callbacks;
+		}
+		else
+		{
+			this->_Callbacks.receive = NULL;
+			this->_Callbacks.transmit = NULL;
+			this->_Callbacks.acceptHeader = NULL;
+		}
+		this->_CallbackContext = context;
+	}
+
+	// DIO0 (RxDone, TxDone, CadDone) is always wired. DIO1 adds rx timeouts, or hop
+	// requests while hopping, and DIO3 the valid header event. NOPIN for either if
+	// it isn't connected
+	void Sx127x::setDioPins(int dio1Pin, int dio3Pin)
+	{
+		_SpiControl->SetDioPins(dio1Pin, dio3Pin);
+		if(dio1Pin != NOPIN)
+		{
+			attachInterrupt(digitalPinToInterrupt(dio1Pin), Sx127x::HandleDio1, _ActiveLowIrq ? FALLING : RISING);
+		}
+		if(dio3Pin != NOPIN)
+		{
+			attachInterrupt(digitalPinToInterrupt(dio3Pin), Sx127x::HandleDio3, _ActiveLowIrq ? FALLING : RISING);
+		}
+	}
+
+	uint8_t Sx127x::DioMapping(uint8_t dio0)
+	{
+		return dio0 | (this->_HopPeriod ? DIO1_FHSS_CHANGE : DIO1_RX_TIMEOUT) | DIO3_VALID_HEADER;
+	}
+
+	// look for a preamble for a couple of symbols and go back to standby. Much
+	// cheaper than receiving, so it's the way to check a channel or wake up for traffic
+	void Sx127x::startCad()
+	{
+		this->standby();
+		_SpiControl->SetSxDir(true);
+		_IrqMode = this->_LoraRcv ? SXIRQ_CAD : SXIRQ_NONE;
+		this->writeRegister(REG_DIO_MAPPING_1, DioMapping(DIO0_CAD_DONE));
+		this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+	}
+
+	// the chip hops every symbols symbols during a packet and asks for the next
+	// channel on DIO1, so this needs setDioPins. Both ends must hop alike
+	void Sx127x::setHopPeriod(uint8_t symbols)
+	{
+		this->_HopPeriod = symbols;
+		this->writeRegister(REG_HOP_PERIOD, symbols);
+	}
+
+	// on a busy channel most packets aren't for us. With a filter the receive interrupt
+	// reads just the first headerBytes and lets the receiver reject the packet before
+	// the rest of the fifo (and the frequency error) is read
+	void Sx127x::setHeaderFilter(uint8_t headerBytes)
+	{
+		this->_FilterBytes = headerBytes;
+	}
+
 	// enable reception. Place an interrupt handler and tell Lora chip to mode RX.
 	void Sx127x::receive(int size)
+	{
+		this->_RxWindow = false;
+		this->StartReceive(size, MODE_RX_CONTINUOUS);
+	}
+
+	// listen once. The chip gives up if no preamble starts within the window (the
+	// symbol timeout, DIO1) and stops after a packet. Either way it then sleeps, so
+	// an exchange costs the window rather than continuous receive
+	void Sx127x::receiveWindow(uint32_t windowUs, int size)
+	{
+		uint32_t symbolUs = SymbolMicros();
+		uint32_t symbols = (windowUs + symbolUs - 1) / symbolUs + SX127X_RX_DETECT_SYMBOLS;
+		symbols = min(symbols, (uint32_t)0x3ff);
+		this->standby();
+		this->writeRegister(REG_MODEM_CONFIG_2, (this->readRegister(REG_MODEM_CONFIG_2) & 0xfc) | (symbols >> 8));
+		this->writeRegister(REG_SYMB_TIMEOUT_LSB, symbols & 0xff);
+		this->_RxWindow = true;
+		this->StartReceive(size, MODE_RX_SINGLE);
+	}
+
+	void Sx127x::StartReceive(int size, uint8_t mode)
 	{
 		_SpiControl->SetSxDir(true);	// enable the RF RX chain
 		this->implicitHeaderMode(size > 0);
@@ -678,19 +923,30 @@ static const bool _ActiveLowIrq = false;
 			this->writeRegister(REG_PAYLOAD_LENGTH, size & 0xff);
 		}
 		// enable rx to raise DIO0
-		if (this->_LoraRcv)
+		if (this->HasHandler())
 		{
-			_IrqFunction = &Sx127x::ReceiveSub;
-			this->writeRegister(REG_DIO_MAPPING_1, 0x00);
+			_IrqMode = SXIRQ_RECEIVE;
+			this->writeRegister(REG_DIO_MAPPING_1, DioMapping(DIO0_RX_DONE));
 		}
 		else
 		{
-			_IrqFunction = nullptr;
+			_IrqMode = SXIRQ_NONE;
 		}
 
 		// The last packet always starts at FIFO_RX_CURRENT_ADDR
 		// no need to reset FIFO_ADDR_PTR
-		this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+		this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | mode);
+	}
+
+	// the chip is in standby after rx single, sleep instead. Also interrupt time.
+	// Without DIO1 nothing reads the timeout flag, and left set it makes the next
+	// good packet look like an rx timeout error
+	void Sx127x::closeWindow()
+	{
+		this->_RxWindow = false;
+		_IrqMode = SXIRQ_NONE;
+		this->writeRegister(REG_IRQ_FLAGS, IRQ_RX_TIME_OUT_MASK);
+		this->sleep();
 	}
 
 	// called by the static receive interrupt handler
@@ -705,17 +961,49 @@ static const bool _ActiveLowIrq = false;
 		uint8_t irqbad = IRQ_PAYLOAD_CRC_ERROR_MASK | IRQ_RX_TIME_OUT_MASK;
 		if ( (irqFlags & IRQ_RX_DONE_MASK) &&
 		     (irqFlags & irqbad) == 0 &&
-			 (this->_LoraRcv != NULL) )
+			 this->HasHandler() )
 			{
 				// it's a receive data ready interrupt
-				this->_LastReceivedTime = millis();
-				this->ReadPayload(payload);
+				this->_LastReceivedTime = _IrqMillis;
+				this->_LastReceivedMicros = _IrqMicros - SX127X_RXDONE_LATENCY_US;
+				this->_LastPacketInfo.endMicros = this->_LastReceivedMicros;
+				bool accepted = this->ReadPayload(payload);
+				if(this->_RxWindow)
+				{
+					this->closeWindow();	// before the receiver can answer
+				}
+				else if(this->_FifoTxBase != FifoTxBaseAddr)
+				{
+					// continuous receive carries on from the end of this packet, toward
+					// the tx half. Restarting it starts the next one back at the bottom
+					this->standby();
+					this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+				}
 				this->acquire_lock(false);	 // unlock when done reading
-				this->_LoraRcv->_doReceive(&payload);
+				if(accepted && this->_Callbacks.receive)
+				{
+					this->_Callbacks.receive(this->_CallbackContext, payload.Data(), payload.Size(), this->_LastPacketInfo);
+				}
+				else if(accepted)
+				{
+					this->_LoraRcv->_doReceive(&payload);
+				}
 			}
 		else
 		{
 			this->acquire_lock(false);			 // unlock in any case.
+			if(this->_RxWindow)
+			{
+				this->closeWindow();
+			}
+			else if(this->_FifoTxBase != FifoTxBaseAddr && (irqFlags & IRQ_RX_DONE_MASK))
+			{
+				// a bad packet went into the fifo too and its length can't be trusted,
+				// so the staged one may be gone. Restart at the bottom as above
+				this->_StagedLength = 0;
+				this->standby();
+				this->writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+			}
 			if (!(irqFlags & IRQ_RX_DONE_MASK))
 			{
 				this->_LastError = "not rx done mask";
@@ -744,11 +1032,15 @@ static const bool _ActiveLowIrq = false;
 		if (irqFlags & IRQ_TX_DONE_MASK)
 		{
 			// it's a transmit finish interrupt
-			this->_LastSentTime = millis();
-			_IrqFunction = nullptr;		// no one to call right now
-			if (this->_LoraRcv)
+			this->_LastSentTime = _IrqMillis;
+			this->_LastSentMicros = _IrqMicros - SX127X_TXDONE_LATENCY_US;
+			_IrqMode = SXIRQ_NONE;		// no one to call right now
+			if (this->_Callbacks.transmit || this->_LoraRcv)
 			{
-				this->_LoraRcv->_doTransmit();
+				if (this->_Callbacks.transmit)
+					this->_Callbacks.transmit(this->_CallbackContext);
+				else
+					this->_LoraRcv->_doTransmit();
 				_SpiControl->SetSxDir(true);	// assume receiver section can use a warmup and anyway uses less power but untested
 			}
 			else
@@ -762,6 +1054,65 @@ static const bool _ActiveLowIrq = false;
 		}
 	}
 
+	// called by the static interrupt handler on CadDone
+	void Sx127x::CadSub()
+	{
+		this->acquire_lock(true);
+		int irqFlags = this->getIrqFlags();
+		this->acquire_lock(false);
+		_IrqMode = SXIRQ_NONE;
+		if(irqFlags & IRQ_CAD_DONE_MASK)
+		{
+			this->_LoraRcv->_doCadDone((irqFlags & IRQ_CAD_DETECTED_MASK) != 0);
+		}
+	}
+
+	// a DIO1 or DIO3 interrupt. Only clear the flags handled here, DIO0 reads its own
+	void Sx127x::LocalDio(uint8_t dioLine)
+	{
+		_SpiControl->TraceIrq(dioLine);
+		if(this->_LoraRcv == NULL)
+		{
+			return;
+		}
+		uint8_t irqFlags = this->readRegister(REG_IRQ_FLAGS);
+		uint8_t handled = irqFlags & (IRQ_RX_TIME_OUT_MASK | IRQ_FHSS_CHANGE_MASK | IRQ_VALID_HEADER_MASK);
+		if(handled == 0)
+		{
+			return;
+		}
+		this->writeRegister(REG_IRQ_FLAGS, handled);
+		if(handled & IRQ_VALID_HEADER_MASK)
+		{
+			this->_LoraRcv->_doValidHeader();
+		}
+		if(handled & IRQ_FHSS_CHANGE_MASK)
+		{
+			this->_LoraRcv->_doHop(this->readRegister(REG_HOP_CHANNEL) & 0x3f);
+		}
+		if(handled & IRQ_RX_TIME_OUT_MASK)
+		{
+			if(this->_RxWindow)
+			{
+				this->closeWindow();
+			}
+			_IrqMode = SXIRQ_NONE;		// the chip is back in standby
+			this->_LoraRcv->_doRxTimeout();
+		}
+	}
+
+	void Sx127x::HandleDio1(void)
+	{
+		if(_Singleton)
+			_Singleton->LocalDio(1);
+	}
+
+	void Sx127x::HandleDio3(void)
+	{
+		if(_Singleton)
+			_Singleton->LocalDio(3);
+	}
+
 	// a static method to receive the interrupt, so this uses _Singleton to call an instance method
 	void Sx127x::HandleInterrupt(void)
 	{
@@ -772,16 +1123,24 @@ static const bool _ActiveLowIrq = false;
 	// called during interrupt to call the local interrupt function
 	void Sx127x::LocalInterrupt()
 	{
-		if(_IrqFunction)
-		{
-			(this->*_IrqFunction)();	// TransmitSub or ReceiveSub
-		}
-		else
+		// before any spi, so the time is the edge plus the interrupt latency
+		_IrqMicros = micros();
+		_IrqMillis = millis();
+		_SpiControl->TraceIrq(0);		// DIO0, for the replay harness
+		switch(_IrqMode)
 		{
-			int irqf = getIrqFlags();	// clear whatever caused the interrupt i guess
-			if(irqf & 0)
-			{
-			}
+			case SXIRQ_RECEIVE:
+				this->ReceiveSub();
+				break;
+			case SXIRQ_TRANSMIT:
+				this->TransmitSub();
+				break;
+			case SXIRQ_CAD:
+				this->CadSub();
+				break;
+			default:
+				getIrqFlags();	// clear whatever caused the interrupt i guess
+				break;
 		}
 	}
 
@@ -789,9 +1148,9 @@ static const bool _ActiveLowIrq = false;
 	bool Sx127x::receivedPacket(int size)
 	{
 		// when no receive handler, this tells if packet ready. Preps for receive
-		if (this->_LoraRcv)
+		if (this->HasHandler())
 		{
-			ASeries.println("Do not call receivedPacket. Use the callback.");
+			LORA_WARN("Do not call receivedPacket. Use the callback.");
 			return false;
 		}
 		int irqFlags = this->getIrqFlags();
@@ -823,18 +1182,45 @@ static const bool _ActiveLowIrq = false;
 	}
 
 	// read the input packet from the Fifo
-	void Sx127x::ReadPayload(TinyVector& tv) 
+	// the fifo pointer, byte count and packet snr/rssi are all in 0x10...0x1b, so one burst
+	// gets them, another gets the frequency error. Then the payload in one more, or two
+	// with a header filter. A filtered packet is left in the fifo, the next one doesn't care
+	bool Sx127x::ReadPayload(TinyVector& tv) 
 	{
+		uint8_t regs[12];			// REG_FIFO_RX_CURRENT_ADDR (0x10) ... REG_RSSI_VALUE (0x1b)
+		this->readRegisters(REG_FIFO_RX_CURRENT_ADDR, regs, sizeof(regs));
 		// set FIFO address to current RX address
-		// fifo_rx_current_addr = this->readRegister(REG_FIFO_RX_CURRENT_ADDR)
-		this->writeRegister(REG_FIFO_ADDR_PTR, this->readRegister(REG_FIFO_RX_CURRENT_ADDR));
+		this->writeRegister(REG_FIFO_ADDR_PTR, regs[0]);
 		// read packet length
-		uint8_t packetLength = this->_ImplicitHeaderMode ? this->readRegister(REG_PAYLOAD_LENGTH) :	this->readRegister(REG_RX_NB_BYTES);
+		uint8_t packetLength = this->_ImplicitHeaderMode ? this->readRegister(REG_PAYLOAD_LENGTH) : regs[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR];
+		if(this->_StagedLength > 0 && regs[0] + packetLength > this->_FifoTxBase)
+		{
+			this->_StagedLength = 0;		// it ran into the tx half
+		}
 		tv.Allocate(packetLength, 1);		// one extra for the null. hopefully this does not reallocate
-		this->_SpiControl->Transfer(REG_FIFO, tv.Data(), packetLength);	// get all data in one spi call
+		int first = packetLength;
+		if(this->_FilterBytes > 0 && (this->_Callbacks.acceptHeader || this->_LoraRcv) && packetLength > this->_FilterBytes)
+		{
+			first = this->_FilterBytes;
+		}
+		this->_SpiControl->Transfer(REG_FIFO, tv.Data(), first);	// get all data in one spi call, if we can
+		if(first < packetLength)
+		{
+			bool accept = this->_Callbacks.acceptHeader ?
+				this->_Callbacks.acceptHeader(this->_CallbackContext, tv.Data(), packetLength) :
+				this->_LoraRcv->_acceptHeader(tv.Data(), packetLength);
+			if(!accept)
+			{
+				return false;
+			}
+			// the fifo pointer carries on from where the first read stopped
+			this->_SpiControl->Transfer(REG_FIFO, tv.Data() + first, packetLength - first);
+		}
 		// do not use tv[packetLength] here because if the allocate moves the Data then
 		// the optimizer uses the wrong pointer...
 		tv.Data()[packetLength] = 0;				// null terminate any strings
+		CapturePacketInfo(regs + (REG_PKT_SNR_VALUE - REG_FIFO_RX_CURRENT_ADDR));
+		return true;
 	}
 
 	uint8_t Sx127x::readRegister(uint8_t address)
@@ -843,6 +1229,11 @@ static const bool _ActiveLowIrq = false;
 		return response;
 	}
 
+	void Sx127x::readRegisters(uint8_t address, uint8_t* buffer, uint8_t count)
+	{
+		this->_SpiControl->Transfer(address & 0x7f, buffer, count);
+	}
+
 	void Sx127x::writeRegister(uint8_t address, uint8_t value)
 	{
 		this->_SpiControl->Transfer(address | 0x80, value);
@@ -860,12 +1251,11 @@ static const bool _ActiveLowIrq = false;
 	// the low data rate flag must be set dependent on the symbol duration > 16ms per spec
 	void Sx127x::setLowDataRate()
 	{
-		// get symbol duration in ms. Spreading factor max=12 so bw/(2**sf) > 6
-		uint16_t symbolDuration = 1000 / ( _SignalBandwidth / (1L << _SpreadingFactor) ); 
+		// the flag is required for symbols over 16ms. SF11 at 125KHz is 16.4ms
 		if(!Is1272())
 		{
 		uint8_t config3 = readRegister(REG_MODEM_CONFIG_3); 
-			if( symbolDuration > 16)
+			if( SymbolMicros() > 16000)
 			{
 			config3 |= 8;
 			}
@@ -874,17 +1264,65 @@ static const bool _ActiveLowIrq = false;
 			config3 &= ~8;
 			}
 			//bitWrite(config3, 3, symbolDuration > 16); 	// set the flag on iff >16ms symbol duration
-			ASeries.printf("Set low data rate flag register: %d", config3);
+			LORA_TRACE("Set low data rate flag register: %d", config3);
 			writeRegister(REG_MODEM_CONFIG_3, config3); 
 		}
 	}
 
+	uint32_t Sx127x::SymbolMicros() const
+	{
+		return (uint32_t)(((uint64_t)1000000 << _SpreadingFactor) / _SignalBandwidth);
+	}
+
+	// the datasheet's time on air formula (4.1.1.6), in integers. The preamble
+	// is _PreambleLength + 4.25 symbols
+	uint32_t Sx127x::timeOnAir(int payloadBytes)
+	{
+		uint32_t symbolUs = SymbolMicros();
+		int lowRate = (symbolUs > 16000) ? 1 : 0;		// same rule as setLowDataRate
+		int bits = 8 * payloadBytes - 4 * _SpreadingFactor + 28 + (_CrcEnabled ? 16 : 0) - (_ImplicitHeaderMode ? 20 : 0);
+		int perBlock = 4 * (_SpreadingFactor - 2 * lowRate);
+		int blocks = max((bits + perBlock - 1) / perBlock, 0);
+		uint32_t symbols = 8 + blocks * _CodingRate;
+		return ((_PreambleLength * 4 + 17) * symbolUs) / 4 + symbols * symbolUs;
+	}
+
 	// This calibrates the system and it reads the current
 	// chip temperature as an integer. Standard is around 242 at 25C.
 	// The manual says calibration should be done when frequency is set to other than default.
 	uint8_t Sx127x::doCalibrate()
+	{
+		return TemperatureAndCalibrate(true);
+	}
+
+	// the low bit of the wideband rssi is noise, so this differs from boot to boot
+	uint32_t Sx127x::randomBits(int count)
+	{
+		uint32_t bits = 0;
+		for(int i = 0; i < count && i < 32; i++)
+		{
+			bits = (bits << 1) | (this->readRegister(REG_RSSI_WIDEBAND) & 1);
+		}
+		return bits;
+	}
+
+	// a preamble has been seen, so a packet may be on its way in. Receive mode only
+	bool Sx127x::isSignalDetected()
+	{
+		return (this->readRegister(REG_MODEM_STAT) & 0x01) != 0;
+	}
+
+	// just read the temperature (about 1ms, the radio is briefly out of lora mode)
+	// it falls one count per degree C so compare readings as int8_t
+	uint8_t Sx127x::readTemperature()
+	{
+		return TemperatureAndCalibrate(false);
+	}
+
+	uint8_t Sx127x::TemperatureAndCalibrate(bool doCalibrate)
 	{
 		int8_t tempr = 0;
+		this->_StagedLength = 0;		// this sleeps, which loses the fifo
 		if(!Is1272())
 		{
 			uint8_t previousOpMode;
@@ -909,17 +1347,20 @@ static const bool _ActiveLowIrq = false;
 			writeRegister(REG_OP_MODE, MODE_SLEEP);		// put into fsk sleep mode
 			tempr = readRegister(REG_TEMP);		// read the temperature
 
-			// as long as we're sleeping and at the right frequency, calibrate...
-			writeRegister(REG_OP_MODE, MODE_STDBY);		// put into fsk standby mode for image cal
-			writeRegister(REG_IMAGE_CAL, (oldCal & IMAGECAL_IMAGECAL_MASK) | IMAGECAL_IMAGECAL_START);	// start calibration
-			int ctr = 0;
-			while( IMAGECAL_IMAGECAL_RUNNING & readRegister(REG_IMAGE_CAL))
+			if(doCalibrate)
 			{
-				delay(1);
-				ctr++;
+				// as long as we're sleeping and at the right frequency, calibrate...
+				writeRegister(REG_OP_MODE, MODE_STDBY);		// put into fsk standby mode for image cal
+				writeRegister(REG_IMAGE_CAL, (oldCal & IMAGECAL_IMAGECAL_MASK) | IMAGECAL_IMAGECAL_START);	// start calibration
+				int ctr = 0;
+				while( IMAGECAL_IMAGECAL_RUNNING & readRegister(REG_IMAGE_CAL))
+				{
+					delay(1);
+					ctr++;
+				}
+				LORA_DEBUG("Delayed %dms while calibrating.", ctr);
+				writeRegister(REG_OP_MODE, MODE_SLEEP);		// put into fsk sleep mode
 			}
-			ASeries.printf("Delayed %dms while calibrating.", ctr);
-			writeRegister(REG_OP_MODE, MODE_SLEEP);		// put into fsk sleep mode
 
 			if(prevOpMode & MODE_LONG_RANGE_MODE)
 			{
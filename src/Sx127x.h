@@ -14,10 +14,34 @@ class TinyVector;
 
 class SpiControl;
 
+// the delay from the end of a packet on air to the DIO0 edge (demodulator and crc
+// pipeline for RxDone, the PA ramp down for TxDone). Override for your board
+#ifndef SX127X_RXDONE_LATENCY_US
+#define SX127X_RXDONE_LATENCY_US 80
+#endif
+#ifndef SX127X_TXDONE_LATENCY_US
+#define SX127X_TXDONE_LATENCY_US 20
+#endif
+// symbols of preamble the chip needs to lock on, added to a receive window
+#ifndef SX127X_RX_DETECT_SYMBOLS
+#define SX127X_RX_DETECT_SYMBOLS 5
+#endif
+
 // these are here so we can default to boost pin
 #define PA_OUTPUT_RFO_PIN 0
 #define PA_OUTPUT_PA_BOOST_PIN 1
 
+// everything the chip tells us about a received packet, captured in two spi
+// bursts when the payload is read. All integer so the interrupt does no float math
+typedef struct
+{
+	int16_t rssi;			// packet rssi in dBm
+	int16_t currentRssi;	// channel rssi in dBm at the end of the packet
+	int8_t snrQuarter;		// packet snr in 0.25 dB steps
+	int32_t freqError;		// estimated transmitter - receiver frequency error in Hz
+	uint32_t endMicros;		// micros() when the packet ended on air
+} LoraPacketInfo;
+
 // we pass in the address of our LoraReceiver to get interrupt driven stuff
 // these methods should be very fast and can't do things like delay or Serial.print
 class LoraReceiver
@@ -25,14 +49,40 @@ class LoraReceiver
 	public:
 		virtual void _doReceive(TinyVector* payload) = 0;
 		virtual void _doTransmit() = 0;
+		// see setHeaderFilter. Return false to skip reading the rest of the packet
+		virtual bool _acceptHeader(const uint8_t* header, int packetLength) { return true; }
+		// the other chip events. Cad comes on DIO0, the rest need setDioPins
+		virtual void _doRxTimeout() {}
+		virtual void _doCadDone(bool detected) {}
+		virtual void _doHop(uint8_t channel) {}		// retune for the next channel now
+		virtual void _doValidHeader() {}			// a packet is arriving
 };
 
 
+// interrupt time callbacks that are called directly, with no virtual dispatch, so
+// small handlers can be inlined. context is what was given to setCallbacks
+typedef void (*LoraReceiveFn)(void* context, uint8_t* data, int length, const LoraPacketInfo& info);
+typedef void (*LoraTransmitFn)(void* context);
+typedef bool (*LoraHeaderFn)(void* context, const uint8_t* header, int packetLength);
+
+typedef struct
+{
+	LoraReceiveFn receive;
+	LoraTransmitFn transmit;
+	LoraHeaderFn acceptHeader;		// NULL to accept every header
+} LoraCallbacks;
+
 // the method prototype for what we pass to the interrupt handler
 typedef void (*InterruptFn)(void);
 
-class Sx127x;
-typedef void (Sx127x::*LocalInterruptFn)(void);
+// what the DIO0 interrupt means now
+enum Sx127xIrq
+{
+	SXIRQ_NONE = 0,
+	SXIRQ_RECEIVE,
+	SXIRQ_TRANSMIT,
+	SXIRQ_CAD
+};
 
 class Sx127x
 {
@@ -53,27 +103,48 @@ class Sx127x
 	// {"power_pin", PA_OUTPUT_PA_BOOST_PIN}
 		bool init(const StringPair* parameters =NULL);			// must be called first. Returns false if not detected
 		void setReceiver(LoraReceiver* receiver);			// use a receiver class on interrupts
+		void setCallbacks(const LoraCallbacks* callbacks, void* context);	// direct receive, transmit and header calls, before the receiver's
+		void setHeaderFilter(uint8_t headerBytes);			// read this much first and ask the receiver, 0 = off
+		void setDioPins(int dio1Pin, int dio3Pin = NOPIN);	// also take interrupts from DIO1 and DIO3
+		void startCad();									// channel activity detection, ends in _doCadDone
+		void setHopPeriod(uint8_t symbols);					// frequency hopping, 0 = off. _doHop on each hop
 		const String& lastError();							// get the last error message if there was one during interrupt
 		void clearLastError();								// clear the prior error message
 
 		void beginPacket(bool implicitHeaderMode=false);	// call before sending a packet
 		void endPacket(); 									// call after filling the fifo to send the packet
+		void enableStaging(bool enable);					// split the fifo so a packet can wait in the tx half
+		void beginStage(bool implicitHeaderMode=false);		// like beginPacket, but for sendStaged
+		void endStage();									// instead of endPacket, stays in standby
+		bool hasStaged() const { return _StagedLength > 0; }	// false once sent, overwritten or lost
+		bool sendStaged();									// send the staged packet now
 		bool isTxDone(); 									// synchronous is transmit complete. clears flag when called.
 		int writeFifo(const uint8_t* buffer, int size);		// write bytes to the fifo
 		void acquire_lock(bool lock=false);					// lock and unlock
 		uint8_t getIrqFlags(); 								// read the irq flags and clear them by writing them
 		uint32_t getLastReceivedTime(void);					// when last got an interrupt
 		uint32_t getLastSentTime(void);						// when last got an interrupt
+		uint32_t getLastReceivedMicros(void);				// micros() at the end of the last packet received
+		uint32_t getLastSentMicros(void);					// micros() at the end of the last packet sent
 		int packetRssi(); 									// get last packet rssi
 		float packetSnr(); 									// get last packet Signal to noise ratio
+		int32_t packetFrequencyError();						// get last packet frequency error (Hz)
+		const LoraPacketInfo& lastPacketInfo();				// all of the last packet's metadata
 		void standby(); 									// put chip in standby
 		void sleep(); 										// put chip to sleep
-		uint8_t doCalibrate();								// run calibration
+		uint8_t doCalibrate();								// run calibration, returns the temperature
+		uint32_t randomBits(int count);					// noise from the wideband rssi, in receive mode
+		bool isSignalDetected();						// something is arriving, in receive mode
+		uint8_t readTemperature();							// temperature without the calibration
 		void setTxPower(int level, int outputPin=PA_OUTPUT_PA_BOOST_PIN);	// set the power level
+		int getTxPower() const { return _TxPower; }		// dBm after clamping
+		int getPaOutputPin() const { return _PaOutputPin; }
 		void setFrequency(double frequency);				// set the center frequency (in Hz)
 		void setFrequencyOffset(double frequency);			// set the frequency deviation
 		void setSpreadingFactor(int sf);					// set spread factor exponent (2**x)
 		void setSignalBandwidth(int sbw);					// set the signal bandwidth
+		int getSpreadingFactor() const { return _SpreadingFactor; }
+		uint32_t getSignalBandwidth() const { return _SignalBandwidth; }	// the bin actually used
 		void setCodingRate(int denominator);				// set coding rate denominator (num=4). 4,5,7,8
 		void setPreambleLength(int length);					// set preamble length
 		void enableCRC(bool enable_CRC=false);				// enable the crc?
@@ -81,19 +152,35 @@ class Sx127x
 		void dumpRegisters(); 								// write all the registers to Serial
 		void implicitHeaderMode(bool implicitHeaderMode=false);	// set the implicit header mode
 		void receive(int size=0);							// prepare to receive
+		void receiveWindow(uint32_t windowUs, int size=0);	// rx single: a packet must start within windowUs, then sleep
+		bool isWindowOpen() const { return _RxWindow; }
+		void closeWindow();									// end a receive window now and sleep
 		bool receivedPacket(int size=0);					// is there a received packet (synchronous)
-		void ReadPayload(TinyVector& tv);					// read the payload from the rcvd packet
+		bool ReadPayload(TinyVector& tv);					// read the payload (and metadata) from the rcvd packet. false if filtered
 		uint8_t readRegister(uint8_t address);				// read an sx127x register
+		void readRegisters(uint8_t address, uint8_t* buffer, uint8_t count);	// burst read consecutive registers
 		void writeRegister(uint8_t address, uint8_t value);	// write to an sx127x register
 		void setLowDataRate();								// set the low data rate flag based on symbol duration
+		uint32_t timeOnAir(int payloadBytes);				// packet duration in microseconds at the current settings
 	private:
 		// these all deals with interrupts
 		void PrepIrqHandler(InterruptFn handlefn);		// set the hardware interrupt handler
 		static void HandleInterrupt();		// which points to this always
+		static void HandleDio1();
+		static void HandleDio3();
+		void LocalDio(uint8_t dioLine);		// DIO1/DIO3 events
+		void CadSub();						// is called on cad done
+		bool HasHandler() const { return _Callbacks.receive != NULL || _LoraRcv != NULL; }
+		uint8_t DioMapping(uint8_t dio0);	// REG_DIO_MAPPING_1 with dio0 doing this
 		void LocalInterrupt();				// which calls this always...
 		void ReceiveSub();					// is called on receive packet
+		void StartReceive(int size, uint8_t mode);
 		void TransmitSub();					// is called on packet sent
 		void SetBits(bool Receive);			// set the rx,tx switch bits
+		void CapturePacketInfo(const uint8_t* pktRegs);		// decode the snr/rssi burst and read fei
+		uint8_t TemperatureAndCalibrate(bool doCalibrate);
+		void WriteCached(uint8_t address, uint8_t& cached, uint8_t value);	// write only if it changed
+		uint32_t SymbolMicros() const;		// 2**sf / bandwidth
 		int ModelNum(void) const;
 		bool Is1272() const { return _ModelNumber == 1272; }
 
@@ -107,14 +194,37 @@ class Sx127x
 		bool _ImplicitHeaderMode;
 		uint8_t	_SpreadingFactor;	// the spreading factor setting
 		uint32_t _SignalBandwidth;	// the signal bandwidth
+		uint8_t _CodingRate;		// denominator, 5..8
+		uint16_t _PreambleLength;	// symbols
+		bool _CrcEnabled;
 		double _Frequency;			// in Hz
+		int _TxPower;				// dBm
+		int _PaOutputPin;			// PA_OUTPUT_RFO_PIN or PA_OUTPUT_PA_BOOST_PIN
+		bool _PaCacheValid;			// the next three match the chip
+		uint8_t _PaConfig;
+		uint8_t _PaDac;
+		uint8_t _Ocp;
 		double _FrequencyOffset;	// for temperature and static compensation
 		uint32_t _LastReceivedTime;	// last receive interrupt time in milliseconds
 		uint32_t _LastSentTime;		// last send interrupt time in milliseconds
+		uint32_t _LastReceivedMicros;	// end of the last packet on air, from the interrupt edge
+		uint32_t _LastSentMicros;
+		volatile uint32_t _IrqMicros;	// taken first thing in the interrupt
+		volatile uint32_t _IrqMillis;
+		LoraPacketInfo _LastPacketInfo;	// metadata of the last packet read
 		LoraReceiver* _LoraRcv;		// who we call on interrupt
+		LoraCallbacks _Callbacks;	// take over from _LoraRcv where set
+		void* _CallbackContext;
+		uint8_t _FilterBytes;		// header bytes read before _acceptHeader, 0 = no filter
+		uint8_t _HopPeriod;			// symbols per hop, 0 = not hopping
+		volatile bool _RxWindow;	// in rx single from receiveWindow
+		uint8_t _FifoTxBase;		// FifoTxBaseAddr, or FifoTxStageAddr when staging
+		uint8_t _FifoWriteBase;		// where the packet being written starts
+		volatile uint8_t _StagedLength;	// bytes waiting in the tx half, 0 = none
+		bool _StagedImplicit;
 		SpiControl* _SpiControl;	// the SPI wrapper
 		TinyVector* _FifoBuf;		// a semi-persistant buffer
-		LocalInterruptFn _IrqFunction; // who to call on interrupt
+		volatile uint8_t _IrqMode;	// Sx127xIrq, who to call on interrupt
 };
 
 #endif
@@ -0,0 +1,95 @@
+// --------------------------------------------------------------------
+// TimeSync fits a line through (local, global) time pairs for LoraUtil
+// Integer sums about the newest point, so micros() wrapping doesn't matter
+// --------------------------------------------------------------------
+#include "Arduino.h"
+#include "TimeSync.h"
+#include "IrqGuard.h"
+
+TimeSync::TimeSync()
+{
+	Clear();
+}
+
+void TimeSync::Clear()
+{
+	IrqGuard guard;
+	_Next = 0;
+	_Count = 0;
+	_Fresh = false;
+	_RefLocal = 0;
+	_RefOffset = 0;
+	_Skew = 0;
+}
+
+// interrupt time
+void TimeSync::AddPoint(uint32_t local, uint32_t global)
+{
+	_Local[_Next] = local;
+	_Offset[_Next] = (int32_t)(global - local);
+	_Next = (_Next + 1) % TIMESYNC_POINTS;
+	if(_Count < TIMESYNC_POINTS)
+	{
+		_Count++;
+	}
+	_Fresh = true;
+}
+
+bool TimeSync::Update()
+{
+	if(!_Fresh)
+	{
+		return false;
+	}
+	uint32_t local[TIMESYNC_POINTS];
+	int32_t offset[TIMESYNC_POINTS];
+	int count;
+	int last;
+	{
+		IrqGuard guard;			// a consistent copy
+		count = _Count;
+		last = (_Next + TIMESYNC_POINTS - 1) % TIMESYNC_POINTS;
+		memcpy(local, _Local, sizeof(local));
+		memcpy(offset, _Offset, sizeof(offset));
+		_Fresh = false;
+	}
+	// x is time before the newest point, y the offset relative to the newest one
+	int32_t x[TIMESYNC_POINTS];
+	int32_t y[TIMESYNC_POINTS];
+	int64_t sumX = 0;
+	int64_t sumY = 0;
+	uint32_t newest = local[last];
+	int32_t base = offset[last];
+	for(int i = 0; i < count; i++)
+	{
+		x[i] = (int32_t)(local[i] - newest);
+		y[i] = offset[i] - base;
+		sumX += x[i];
+		sumY += y[i];
+	}
+	int32_t meanX = (int32_t)(sumX / count);
+	int32_t meanY = (int32_t)(sumY / count);
+	int64_t sxx = 0;
+	int64_t sxy = 0;
+	for(int i = 0; i < count; i++)
+	{
+		int64_t dx = x[i] - meanX;
+		sxx += dx * dx;
+		sxy += dx * (y[i] - meanY);
+	}
+	_Skew = (sxx > 0) ? (float)sxy / (float)sxx : 0;
+	_RefLocal = newest + meanX;
+	_RefOffset = base + meanY;
+	return true;
+}
+
+int TimeSync::Points()
+{
+	return _Count;
+}
+
+uint32_t TimeSync::ToGlobal(uint32_t local) const
+{
+	int32_t since = (int32_t)(local - _RefLocal);
+	return local + _RefOffset + (int32_t)(_Skew * since);
+}
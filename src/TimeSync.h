@@ -0,0 +1,39 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdint.h>
+
+// Estimates the reference's clock from our own. Each point pairs our micros() at an
+// event with the reference's time of the same event. A least squares line through
+// the last TIMESYNC_POINTS gives the offset and the drift (skew) between the clocks.
+// Points come from the receive interrupt; Update refits from the loop.
+
+#ifndef TIMESYNC_POINTS
+#define TIMESYNC_POINTS 8
+#endif
+
+class TimeSync
+{
+	public:
+		TimeSync();
+		void Clear();
+		void AddPoint(uint32_t local, uint32_t global);	// interrupt time
+		bool Update();						// refit if there are new points. true if it did
+		int Points();
+		uint32_t ToGlobal(uint32_t local) const;	// identity until there's a point
+		int32_t Offset() const { return _RefOffset; }	// global - local at the last fit, us
+		float Skew() const { return _Skew; }		// global rate / local rate - 1
+
+	private:
+		uint32_t _Local[TIMESYNC_POINTS];
+		int32_t _Offset[TIMESYNC_POINTS];	// global - local, wraps with the clocks
+		uint8_t _Next;
+		uint8_t _Count;
+		volatile bool _Fresh;
+		// the fit: global = local + _RefOffset + _Skew * (local - _RefLocal)
+		uint32_t _RefLocal;
+		int32_t _RefOffset;
+		float _Skew;
+};
+
+#endif // TIME_SYNC_H